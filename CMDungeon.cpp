@@ -14,6 +14,9 @@
 #include <cmath>
 #include <limits>
 #include <stack>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
 
 using namespace std;
 
@@ -45,18 +48,36 @@ struct Room
 	int sizeX{}, sizeY{};
 	int mapX{}, mapY{};
 	int offsetX{}, offsetY{};
-	vector<vector<Tile>> tiles;
 	vector<Direction> doors;
 
 	int maxSizeX = 12, maxSizeY = 24;
 };
 
+// A light source on a tile, lighting everything within radius tiles with a linear falloff.
+struct Light {
+	int x{}, y{};
+	int radius{};
+	unsigned char intensity{};
+	bool on = false;
+};
+
+// Per tile light level 0-255, indexed like map.map. Static room torches are baked once,
+// dynamic lights are added on top and only ever relight the tiles within their radius.
+struct LightMap {
+	int sizeX{}, sizeY{};
+	vector<unsigned char> baked;
+	vector<unsigned char> level; // baked + dynamic lights, what renderMap reads
+	vector<Light> dynamicLights; // switched off lights are free slots
+};
+
 struct Map {
 	int viewSizeX{}, viewSizeY{};
 	int mapSizeX{}, mapSizeY{};
 	int playerX{}, playerY{};
+	int lantern = -1; // dynamic light following the player
 	vector<vector<Room>> rooms;
 	vector<vector<Tile>> map;
+	LightMap lights;
 
 	int roomsX = 7, roomsY = 7;
 };
@@ -76,26 +97,48 @@ void getTerminalSize(int& width, int& height) {
 #endif // Windows/Linux
 }
 
-int randInt(int min, int max)
+// Counter-based generator: draw n of a stream is a SplitMix64 hash of the stream's key and n, so
+// no global state is involved. Keys mix the seed, the room's cell and what the draws are for, so
+// mirrored cells like (1, 2) and (2, 1) get unrelated rooms.
+enum RandomStream
 {
-	return (int)(rand() % (max - min)) + min;
+	ROOM_STREAM, // room size and offset
+	DOOR_STREAM, // door count, walls and positions
+};
+
+uint64_t mixBits(uint64_t z) {
+	z += 0x9e3779b97f4a7c15ull;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
 }
 
-Direction randDirection(unsigned int seed)
+struct Random {
+	uint64_t key{};
+	uint64_t counter{};
+};
+
+Random randomStream(int x, int y, RandomStream stream, unsigned int globalSeed = 2137420)
 {
-	srand(seed);
-	const Direction allDir[4] = { NORTH, WEST, EAST, SOUTH };
-	return allDir[randInt(0, 4)];
+	Random random;
+	random.key = mixBits(mixBits(mixBits(globalSeed) ^ ((uint64_t)(uint32_t)x << 32 | (uint32_t)y)) ^ stream);
+	return random;
 }
 
-unsigned int getSeed(int x, int y, unsigned int globalSeed = 2137420)
+uint32_t nextRandom(Random& random)
 {
-	return (unsigned int)x + y + 420 * 2137 * 69 * globalSeed;
+	return (uint32_t)(mixBits(random.key + random.counter++ * 0x9e3779b97f4a7c15ull) >> 32);
 }
 
-Tile randTile(Room room)
+int randInt(Random& random, int min, int max)
 {
-	return room.tiles[randInt(0, room.sizeX)][randInt(0, room.sizeY)];
+	return min + (int)(((uint64_t)nextRandom(random) * (uint32_t)(max - min)) >> 32);
+}
+
+Direction randDirection(Random& random)
+{
+	const Direction allDir[4] = { NORTH, WEST, EAST, SOUTH };
+	return allDir[randInt(random, 0, 4)];
 }
 
 char stateToChar(tileState s)
@@ -128,62 +171,158 @@ bool isWalkthru(tileState state) {
 
 Room* getRoomFromMapCoords(Map& map, int x, int y) {
 	Room r;
-	return &map.rooms[(int)x / r.maxSizeX][(int)x / r.maxSizeY];
+	return &map.rooms[x / r.maxSizeX][y / r.maxSizeY];
+}
+
+//----------[ LIGHTING ]-----------------
+
+const unsigned char ambientLight = 24;
+const unsigned char litFloor = 96;
+
+unsigned char lightFalloff(const Light& light, int x, int y) {
+	int dx = x - light.x, dy = y - light.y;
+	if (dx * dx + dy * dy > light.radius * light.radius) return 0;
+	float d = sqrt((float)(dx * dx + dy * dy));
+	return (unsigned char)(light.intensity * (1 - d / (light.radius + 1)));
+}
+
+unsigned char lightAt(const LightMap& lights, int x, int y) {
+	if (x < 0 || y < 0 || x >= lights.sizeX || y >= lights.sizeY) return 0;
+	return lights.level[(size_t)x * lights.sizeY + y];
+}
+
+// One torch in the middle of every room, lighting the room up to and including its walls.
+void bakeLights(LightMap& lights, const Map& map) {
+	lights.sizeX = map.mapSizeX;
+	lights.sizeY = map.mapSizeY;
+	lights.baked.assign((size_t)map.mapSizeX * map.mapSizeY, ambientLight);
+	for (const vector<Room>& column : map.rooms)
+		for (const Room& room : column) {
+			int x0 = room.mapX * room.maxSizeX + room.offsetX;
+			int y0 = room.mapY * room.maxSizeY + room.offsetY;
+			Light torch;
+			torch.x = x0 + room.sizeX / 2;
+			torch.y = y0 + room.sizeY / 2;
+			torch.radius = max(room.sizeX, room.sizeY);
+			torch.intensity = 220;
+			for (int x = x0; x < x0 + room.sizeX; x++)
+				for (int y = y0; y < y0 + room.sizeY; y++) {
+					unsigned char& baked = lights.baked[(size_t)x * map.mapSizeY + y];
+					baked = max(baked, lightFalloff(torch, x, y));
+				}
+		}
+	lights.level = lights.baked;
+}
+
+// Recomputes level inside the box [x0, x1] x [y0, y1] from the baked map and the dynamic lights reaching into it.
+void relightRegion(LightMap& lights, int x0, int y0, int x1, int y1) {
+	x0 = max(x0, 0); y0 = max(y0, 0);
+	x1 = min(x1, lights.sizeX - 1); y1 = min(y1, lights.sizeY - 1);
+	for (int x = x0; x <= x1; x++)
+		memcpy(&lights.level[(size_t)x * lights.sizeY + y0], &lights.baked[(size_t)x * lights.sizeY + y0], y1 - y0 + 1);
+
+	for (const Light& light : lights.dynamicLights) {
+		if (!light.on) continue;
+		int lx0 = max(x0, light.x - light.radius), lx1 = min(x1, light.x + light.radius);
+		int ly0 = max(y0, light.y - light.radius), ly1 = min(y1, light.y + light.radius);
+		for (int x = lx0; x <= lx1; x++)
+			for (int y = ly0; y <= ly1; y++) {
+				unsigned char& level = lights.level[(size_t)x * lights.sizeY + y];
+				level = max(level, lightFalloff(light, x, y));
+			}
+	}
+}
+
+void relightAround(LightMap& lights, const Light& light) {
+	relightRegion(lights, light.x - light.radius, light.y - light.radius, light.x + light.radius, light.y + light.radius);
+}
+
+int addLight(LightMap& lights, Light light) {
+	light.on = true;
+	size_t slot = 0;
+	while (slot < lights.dynamicLights.size() && lights.dynamicLights[slot].on) slot++;
+	if (slot == lights.dynamicLights.size()) lights.dynamicLights.push_back(light);
+	else lights.dynamicLights[slot] = light;
+	relightAround(lights, light);
+	return (int)slot;
+}
+
+void moveLight(LightMap& lights, int index, int x, int y) {
+	Light& light = lights.dynamicLights[index];
+	if (light.x == x && light.y == y) return;
+	Light old = light;
+	light.x = x;
+	light.y = y;
+	relightAround(lights, old);
+	relightAround(lights, light);
+}
+
+void updateLantern(Map& map) {
+	if (map.lantern < 0) {
+		Light lantern;
+		lantern.x = map.playerX;
+		lantern.y = map.playerY;
+		lantern.radius = 5;
+		lantern.intensity = 200;
+		map.lantern = addLight(map.lights, lantern);
+		return;
+	}
+	moveLight(map.lights, map.lantern, map.playerX, map.playerY);
 }
 
 //----------[ MAP FUNCTIONS ]-----------------
-Room generateRandomRoom(int x, int y)
+// Writes the room straight into its cell of map.map, only the metadata and doors are kept in the Room.
+Room generateRandomRoom(Map& map, int x, int y)
 {
-	unsigned int roomSeed = getSeed(x, y);
 	Room randRoom;
-	srand(roomSeed);
+	Random random = randomStream(x, y, ROOM_STREAM);
 
 	randRoom.mapX = x;
 	randRoom.mapY = y;
 
-	randRoom.sizeX = randInt(8, randRoom.maxSizeX);
-	randRoom.sizeY = randInt(8, randRoom.maxSizeY);
+	randRoom.sizeX = randInt(random, 8, randRoom.maxSizeX);
+	randRoom.sizeY = randInt(random, 8, randRoom.maxSizeY);
 
-	randRoom.offsetX = randInt(0, randRoom.maxSizeX - randRoom.sizeX);
-	randRoom.offsetY = randInt(0, randRoom.maxSizeY - randRoom.sizeY);
+	randRoom.offsetX = randInt(random, 0, randRoom.maxSizeX - randRoom.sizeX);
+	randRoom.offsetY = randInt(random, 0, randRoom.maxSizeY - randRoom.sizeY);
+
+	int mapX = randRoom.mapX * randRoom.maxSizeX;
+	int mapY = randRoom.mapY * randRoom.maxSizeY;
+	auto setState = [&](int rX, int rY, tileState state) {
+		Tile& tile = map.map[mapX + rX][mapY + rY];
+		if (tile.state != UNDESTRUCT_WALL) tile.state = state;
+	};
 
 	for (int x = 0; x < randRoom.maxSizeX; x++)
 	{
-		vector<Tile> temp;
 		for (int y = 0; y < randRoom.maxSizeY; y++)
-
 		{
-			Tile tile;
-			tile.x = x;
-			tile.y = y;
-
 			if (
 				(x == randRoom.offsetX && y < randRoom.sizeY + randRoom.offsetY && y >= randRoom.offsetY)
 				|| (x == randRoom.sizeX + randRoom.offsetX - 1 && y < randRoom.sizeY + randRoom.offsetY && y> randRoom.offsetY)
 				|| (y == randRoom.offsetY && x < randRoom.sizeX + randRoom.offsetX && x >= randRoom.offsetX)
 				|| (y == randRoom.sizeY + randRoom.offsetY - 1 && x < randRoom.sizeX + randRoom.offsetX && x> randRoom.offsetX)
 				)
-				tile.state = WALL;
+				setState(x, y, WALL);
 			if (x > randRoom.offsetX && x < randRoom.sizeX + randRoom.offsetX - 1 && y > randRoom.offsetY && y < randRoom.sizeY + randRoom.offsetY - 1)
-				tile.state = ROOM_AIR;
-
-			temp.push_back(tile);
+				setState(x, y, ROOM_AIR);
 		}
-		randRoom.tiles.push_back(temp);
 	}
 
-	for (int i = 0; i < roomSeed % 3 + 2; i++)
+	Random doors = randomStream(x, y, DOOR_STREAM);
+	int doorCount = randInt(doors, 2, 5);
+	for (int i = 0; i < doorCount; i++)
 	{
-		Direction randDir = randDirection(roomSeed + i);
+		Direction randDir = randDirection(doors);
 		randRoom.doors.push_back(randDir);
 		if (randDir == NORTH)
-			randRoom.tiles[randRoom.offsetX][randInt(1 + randRoom.offsetY, randRoom.sizeY + randRoom.offsetY - 2)].state = DOOR;
+			setState(randRoom.offsetX, randInt(doors, 1 + randRoom.offsetY, randRoom.sizeY + randRoom.offsetY - 2), DOOR);
 		if (randDir == SOUTH)
-			randRoom.tiles[randRoom.sizeX + randRoom.offsetX - 1][randInt(1 + randRoom.offsetY, randRoom.sizeY + randRoom.offsetY - 2)].state = DOOR;
+			setState(randRoom.sizeX + randRoom.offsetX - 1, randInt(doors, 1 + randRoom.offsetY, randRoom.sizeY + randRoom.offsetY - 2), DOOR);
 		if (randDir == WEST)
-			randRoom.tiles[randInt(1 + randRoom.offsetX, randRoom.sizeX + randRoom.offsetX - 2)][randRoom.offsetY].state = DOOR;
+			setState(randInt(doors, 1 + randRoom.offsetX, randRoom.sizeX + randRoom.offsetX - 2), randRoom.offsetY, DOOR);
 		if (randDir == EAST)
-			randRoom.tiles[randInt(1 + randRoom.offsetX, randRoom.sizeX + randRoom.offsetX - 2)][randRoom.sizeY + randRoom.offsetY - 1].state = DOOR;
+			setState(randInt(doors, 1 + randRoom.offsetX, randRoom.sizeX + randRoom.offsetX - 2), randRoom.sizeY + randRoom.offsetY - 1, DOOR);
 	}
 
 	return randRoom;
@@ -207,6 +346,7 @@ void renderMap(Map& map)
 		{
 			cout.width(2);
 			if (map.playerX == x && map.playerY == y) { cout << "P"; continue; }
+			if (isWalkthru(map.map[x][y].state) && lightAt(map.lights, x, y) >= litFloor) { cout << '.'; continue; }
 			cout << stateToChar(map.map[x][y].state);
 			//cout <<map.map[x][y].state;
 		}
@@ -218,10 +358,11 @@ Tile findClosestDoor(Map& map, int sX, int sY) {
 	Tile closest = map.map[sX][sY];
 	float closestDist = FLT_MAX;
 
+	Room* own = getRoomFromMapCoords(map, sX, sY);
 	for (int x = 0; x < map.mapSizeX; x++)
 		for (int y = 0; y < map.mapSizeY; y++) {
-			if (getRoomFromMapCoords(map, x, y) == getRoomFromMapCoords(map, sX, sY)) continue;
 			if (map.map[x][y].state != DOOR || (x == sX && y == sY)) continue;
+			if (getRoomFromMapCoords(map, x, y) == own) continue;
 			if (closestDist > getDistance(sX, sY, x, y)) {
 				closestDist = getDistance(sX, sY, x, y);
 				closest = map.map[x][y];
@@ -249,25 +390,12 @@ void generateMap(Map& map) {
 	}
 
 	cout << "Creating rooms..." << endl;
-	for (int x = 0; x < map.roomsX; x++) {
-		vector<Room> temp;
-		for (int y = 0; y < map.roomsY; y++) {
-			Room room = generateRandomRoom(x, y);
-
-			int mapX = room.mapX * room.maxSizeX;
-			int mapY = room.mapY * room.maxSizeY;
-
-			for (int rX = 0; rX < room.maxSizeX; rX++)
-				for (int rY = 0; rY < room.maxSizeY; rY++)
-					if (map.map[mapX + rX][mapY + rY].state != UNDESTRUCT_WALL)
-						map.map[mapX + rX][mapY + rY].state = room.tiles[rX][rY].state;
-
-			temp.push_back(room);
-		}
-		map.rooms.push_back(temp);
-	}
+	map.rooms.assign(map.roomsX, vector<Room>(map.roomsY));
+	for (int x = 0; x < map.roomsX; x++)
+		for (int y = 0; y < map.roomsY; y++)
+			map.rooms[x][y] = generateRandomRoom(map, x, y);
 
-	Room centerRoom = map.rooms[map.roomsX / 2][map.roomsY / 2];
+	const Room& centerRoom = map.rooms[map.roomsX / 2][map.roomsY / 2];
 	map.playerX = centerRoom.mapX * r.maxSizeX + centerRoom.sizeX / 2;
 	map.playerY = centerRoom.mapY * r.maxSizeY + centerRoom.sizeY / 2;
 }
@@ -293,6 +421,7 @@ void movePlayer(Map& map, Direction dir) {
 	if (isWalkthru(map.map[newX][newY].state)) {
 		map.playerX = newX;
 		map.playerY = newY;
+		updateLantern(map);
 	}
 }
 
@@ -312,7 +441,7 @@ inline bool operator < (const Node& lhs, const Node& rhs)
 	return lhs.fCost < rhs.fCost;
 }
 
-bool isValid(int x, int y, Map map) {
+bool isValid(int x, int y, const Map& map) {
 	if (x < 0 && y < 0 && x >= map.mapSizeX && y >= map.mapSizeY) return false;
 	if (map.map[x][y].state == AIR || map.map[x][y].state == DOOR) return true;
 	return false;
@@ -328,7 +457,7 @@ bool isDestination(int x, int y, Node tile) {
 	return (tile.x == x && tile.y == y);
 }
 
-vector<Node> makePath(vector<vector<Node>> map, Node destination, Map m) {
+vector<Node> makePath(const vector<vector<Node>>& map, Node destination, const Map& m) {
 	try {
 		int x = destination.x;
 		int y = destination.y;
@@ -369,14 +498,12 @@ vector<Node> makePath(vector<vector<Node>> map, Node destination, Map m) {
 	catch (const exception& e) {}
 }
 
-vector<Node> aStar(Map map, Node start, Node destination) {
+vector<Node> aStar(const Map& map, Node start, Node destination) {
 	vector<Node> empty;
 	if (!isValid(destination.x, destination.y, map)) return empty;
 	if (isDestination(start.x, start.y, destination)) return empty;
 
-	bool** closedList = new bool* [map.mapSizeX];
-	for (int i = 0; i < map.mapSizeX; i++)
-		closedList[i] = new bool[map.mapSizeY];
+	vector<vector<bool>> closedList(map.mapSizeX, vector<bool>(map.mapSizeY));
 
 	vector<vector<Node>> allMap;
 	for (int x = 0; x < map.mapSizeX; x++) {
@@ -471,14 +598,49 @@ Tile nodeToTile(Node node, Map& map) {
 	return map.map[node.x][node.y];
 }
 
+// Numbers the patches of tiles searches can step onto, 8-connected like the search itself, -1
+// everywhere else. A search between two patches can only fail after visiting all of its own.
+vector<vector<int>> labelReach(const Map& map) {
+	vector<vector<int>> reach(map.mapSizeX, vector<int>(map.mapSizeY, -1));
+	vector<Node> stack;
+	int label = 0;
+	for (int x = 0; x < map.mapSizeX; x++)
+		for (int y = 0; y < map.mapSizeY; y++) {
+			if (reach[x][y] != -1 || !isValid(x, y, map)) continue;
+			Node start;
+			start.x = x;
+			start.y = y;
+			reach[x][y] = label;
+			stack.push_back(start);
+			while (!stack.empty()) {
+				Node node = stack.back();
+				stack.pop_back();
+				for (int nX = node.x - 1; nX <= node.x + 1; nX++)
+					for (int nY = node.y - 1; nY <= node.y + 1; nY++) {
+						if (nX < 0 || nY < 0 || nX >= map.mapSizeX || nY >= map.mapSizeY) continue;
+						if (reach[nX][nY] != -1 || !isValid(nX, nY, map)) continue;
+						Node next;
+						next.x = nX;
+						next.y = nY;
+						reach[nX][nY] = label;
+						stack.push_back(next);
+					}
+			}
+			label++;
+		}
+	return reach;
+}
+
 void connectRooms(Map& map) {
 	vector<vector<Node>> allPaths;
 
 	cout << "Connecting rooms..." << endl;
+	vector<vector<int>> reach = labelReach(map);
 	for (int x = 0; x < map.mapSizeX; x++) {
 		for (int y = 0; y < map.mapSizeY; y++) {
 			if (map.map[x][y].state != DOOR) continue;
 			Node closestDoor = tileToNode(findClosestDoor(map, x, y));
+			if (reach[x][y] != reach[closestDoor.x][closestDoor.y]) continue;
 			vector<Node> path = aStar(map, tileToNode(map.map[x][y]), closestDoor);
 			allPaths.push_back(path);
 		}
@@ -558,6 +720,8 @@ int main()
 	map.viewSizeX--;
 	generateMap(map);
 	connectRooms(map);
+	bakeLights(map.lights, map);
+	updateLantern(map);
 	renderMap(map);
 	mainLoop(map);
 
@@ -3,10 +3,18 @@
 #define VC_EXTRALEAN
 #include <Windows.h>
 #include <conio.h>
+#include <intrin.h>
 #elif defined(__linux__)
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
 #endif
 #include <iostream>
 #include <vector>
@@ -15,7 +23,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits>
+#include <climits>
 #include <stack>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #define PI 3.14159265359
 #define P2 PI/2
@@ -24,6 +44,368 @@
 
 using namespace std;
 
+// ----------[ MEMORY ]--------------
+// Bytes per subsystem. Arena blocks are charged when they are allocated and released when they
+// are freed, everything else is measured from container capacities when a report is made.
+
+enum MemorySubsystem
+{
+	GENERATION_MEMORY,  // the map arena: dense tile grid, door list and corridor bits
+	PATHFINDING_MEMORY, // A* scratch
+	TILE_MEMORY,        // runtime tile runs and the edit log
+	ROOM_MEMORY,        // the room arena: rooms and room hash
+	LIGHTING_MEMORY,
+	DERIVED_MEMORY,     // distance field, overview pyramid and region labels
+	SPRITE_MEMORY,
+	VIEW_MEMORY,
+
+	MEMORY_SUBSYSTEMS,
+};
+
+const char* const memorySubsystemNames[MEMORY_SUBSYSTEMS] = { "generation", "pathfinding", "tiles", "rooms", "lighting", "derived", "sprites", "view" };
+
+struct MemoryAccount {
+	size_t budget = 0; // bytes, 0 for no limit
+	atomic<size_t> live[MEMORY_SUBSYSTEMS]{};
+	atomic<size_t> peak[MEMORY_SUBSYSTEMS]{};
+	atomic<size_t> total{ 0 }, totalPeak{ 0 };
+};
+
+void charge(MemoryAccount* account, MemorySubsystem subsystem, size_t bytes) {
+	if (!account) return;
+	size_t live = account->live[subsystem] += bytes;
+	size_t peak = account->peak[subsystem];
+	while (live > peak && !account->peak[subsystem].compare_exchange_weak(peak, live)) {}
+	size_t total = account->total += bytes;
+	size_t totalPeak = account->totalPeak;
+	while (total > totalPeak && !account->totalPeak.compare_exchange_weak(totalPeak, total)) {}
+}
+
+void release(MemoryAccount* account, MemorySubsystem subsystem, size_t bytes) {
+	if (!account) return;
+	account->live[subsystem] -= bytes;
+	account->total -= bytes;
+}
+
+template <typename T>
+size_t vectorBytes(const vector<T>& v) {
+	return v.capacity() * sizeof(T);
+}
+
+template <typename T>
+size_t vectorBytes(const vector<vector<T>>& v) {
+	size_t bytes = v.capacity() * sizeof(vector<T>);
+	for (const vector<T>& inner : v) bytes += vectorBytes(inner);
+	return bytes;
+}
+
+// ----------[ TRACE ]--------------
+// Scoped spans for looking at a slow startup or a stuttering session on a timeline. Every thread
+// records into a ring buffer of its own, so recording never takes a lock. The newest
+// traceRingEvents spans of every ring are written out as Chrome trace-event JSON (chrome://tracing,
+// Perfetto) when the program exits and, on Linux, on SIGUSR1. Off unless startTrace was called;
+// a span then costs one relaxed load.
+
+const uint64_t traceRingEvents = 1 << 14;
+
+struct TraceEvent {
+	const char* name = nullptr; // a literal, only the pointer is kept
+	int64_t start{}, end{};     // nanoseconds since startTrace
+	int thread{};
+	int x = -1, y = -1;         // the tile the span is about, if any
+};
+
+// A TraceEvent in a ring. Its fields are relaxed atomics, so a dump can copy the slot while the
+// ring's thread writes over it; the copy is dropped if it may mix two events.
+struct TraceSlot {
+	atomic<const char*> name{ nullptr };
+	atomic<int64_t> start{ 0 }, end{ 0 };
+	atomic<int> thread{ 0 }, x{ -1 }, y{ -1 };
+};
+
+// Written by one thread at a time. `written` counts every event ever recorded, so a reader can
+// copy the last traceRingEvents and drop the ones the writer lapped while it was copying: a
+// sequence lock, with the fences in recordSpan and writeTrace ordering the slots against it.
+struct TraceRing {
+	TraceSlot events[traceRingEvents];
+	atomic<uint64_t> written{ 0 };
+};
+
+struct TraceLog {
+	atomic<bool> enabled{ false };
+	string path;
+	chrono::steady_clock::time_point origin;
+
+	mutex m; // handing out rings, naming threads, writing the file; recording never takes it
+	vector<unique_ptr<TraceRing>> rings;
+	vector<TraceRing*> freeRings; // left behind by threads that exited, events and all
+	vector<string> threadNames;   // by thread number
+};
+
+TraceLog traceLog;
+
+// A thread gets a ring with its first span and hands it back when it exits, so the routing
+// threads every floor starts share the same few rings.
+struct TraceThread {
+	TraceRing* ring = nullptr;
+	int thread = -1;
+
+	~TraceThread() {
+		if (!ring) return;
+		lock_guard<mutex> lock(traceLog.m);
+		traceLog.freeRings.push_back(ring);
+	}
+};
+
+thread_local TraceThread traceThread;
+
+TraceThread& currentTraceThread() {
+	if (traceThread.ring) return traceThread;
+	lock_guard<mutex> lock(traceLog.m);
+	if (!traceLog.freeRings.empty()) {
+		traceThread.ring = traceLog.freeRings.back();
+		traceLog.freeRings.pop_back();
+	}
+	else {
+		traceLog.rings.push_back(make_unique<TraceRing>());
+		traceThread.ring = traceLog.rings.back().get();
+	}
+	traceThread.thread = (int)traceLog.threadNames.size();
+	traceLog.threadNames.push_back("thread " + to_string(traceThread.thread));
+	return traceThread;
+}
+
+int64_t traceNow() {
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - traceLog.origin).count();
+}
+
+// Shown instead of "thread <n>".
+void traceThreadName(const char* name) {
+	if (!traceLog.enabled.load(memory_order_relaxed)) return;
+	TraceThread& thread = currentTraceThread();
+	lock_guard<mutex> lock(traceLog.m);
+	traceLog.threadNames[thread.thread] = name;
+}
+
+void recordSpan(const char* name, int64_t start, int64_t end, int x, int y) {
+	TraceThread& thread = currentTraceThread();
+	TraceRing& ring = *thread.ring;
+	uint64_t written = ring.written.load(memory_order_relaxed);
+	TraceSlot& slot = ring.events[written % traceRingEvents];
+	// a reader that sees any of these stores also sees that event `written` was under way
+	atomic_thread_fence(memory_order_release);
+	slot.name.store(name, memory_order_relaxed);
+	slot.start.store(start, memory_order_relaxed);
+	slot.end.store(end, memory_order_relaxed);
+	slot.thread.store(thread.thread, memory_order_relaxed);
+	slot.x.store(x, memory_order_relaxed);
+	slot.y.store(y, memory_order_relaxed);
+	ring.written.store(written + 1, memory_order_release);
+}
+
+// Records the time between its construction and its destruction.
+struct TraceSpan {
+	const char* name;
+	int x, y;
+	int64_t start = -1;
+
+	TraceSpan(const char* name, int x = -1, int y = -1) : name(name), x(x), y(y) {
+		if (traceLog.enabled.load(memory_order_relaxed)) start = traceNow();
+	}
+	~TraceSpan() {
+		if (start >= 0) recordSpan(name, start, traceNow(), x, y);
+	}
+};
+
+// Overwrites traceLog.path with what the rings hold now. Safe while other threads record.
+bool writeTrace() {
+	lock_guard<mutex> lock(traceLog.m);
+	FILE* file = fopen(traceLog.path.c_str(), "wb");
+	if (!file) return false;
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+	bool first = true;
+	for (size_t t = 0; t < traceLog.threadNames.size(); t++) {
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", t,
+			traceLog.threadNames[t].c_str());
+		first = false;
+	}
+	vector<TraceEvent> events;
+	for (const unique_ptr<TraceRing>& ring : traceLog.rings) {
+		uint64_t end = ring->written.load(memory_order_acquire);
+		uint64_t begin = end > traceRingEvents ? end - traceRingEvents : 0;
+		events.resize(end - begin);
+		for (uint64_t i = begin; i < end; i++) {
+			const TraceSlot& slot = ring->events[i % traceRingEvents];
+			TraceEvent& event = events[i - begin];
+			event.name = slot.name.load(memory_order_relaxed);
+			event.start = slot.start.load(memory_order_relaxed);
+			event.end = slot.end.load(memory_order_relaxed);
+			event.thread = slot.thread.load(memory_order_relaxed);
+			event.x = slot.x.load(memory_order_relaxed);
+			event.y = slot.y.load(memory_order_relaxed);
+		}
+		// the slot of event `after` was being written over, and every one before it
+		atomic_thread_fence(memory_order_acquire);
+		uint64_t after = ring->written.load(memory_order_relaxed);
+		uint64_t lapped = after >= traceRingEvents ? after - traceRingEvents + 1 : 0;
+		for (uint64_t i = max(begin, lapped); i < end; i++) {
+			const TraceEvent& event = events[i - begin];
+			fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", first ? "" : ",\n", event.name,
+				event.thread, event.start / 1000.0, (event.end - event.start) / 1000.0);
+			if (event.x >= 0) fprintf(file, ",\"args\":{\"x\":%d,\"y\":%d}", event.x, event.y);
+			fputc('}', file);
+			first = false;
+		}
+	}
+	fputs("\n]}\n", file);
+	return fclose(file) == 0;
+}
+
+#if defined(__linux__)
+// SIGUSR1 writes the trace and carries on, SIGINT and SIGTERM write it and quit. The signals are
+// blocked in every thread and taken by sigwait on a thread of their own, so the trace is written
+// by ordinary code rather than a signal handler. Has to run before any other thread starts.
+void startTraceSignals() {
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	thread([signals] {
+		traceThreadName("trace signals");
+		while (true) {
+			int signal;
+			if (sigwait(&signals, &signal) != 0) continue;
+			writeTrace();
+			if (signal != SIGUSR1) _exit(128 + signal);
+		}
+	}).detach();
+}
+#endif // Linux
+
+// Records from here on, names the calling thread "main" and writes the trace to path at exit.
+void startTrace(const char* path) {
+	traceLog.path = path;
+	traceLog.origin = chrono::steady_clock::now();
+	traceLog.enabled.store(true);
+	traceThreadName("main");
+	atexit([] { writeTrace(); });
+#if defined(__linux__)
+	startTraceSignals();
+#endif // Linux
+}
+
+// ----------[ ARENA ]--------------
+// Bump allocator for one floor's generation data. Nothing is freed on its own,
+// the arena is rewound to a mark or released as a whole.
+
+// Frees a block and takes it off the account it was charged to.
+struct ArenaFree {
+	MemoryAccount* account = nullptr;
+	MemorySubsystem subsystem = GENERATION_MEMORY;
+	size_t size{};
+	void operator()(unsigned char* memory) const {
+		delete[] memory;
+		release(account, subsystem, size);
+	}
+};
+
+struct ArenaBlock {
+	unique_ptr<unsigned char[], ArenaFree> memory;
+	size_t size{};
+};
+
+struct Arena {
+	vector<ArenaBlock> blocks;
+	size_t used{}; // bytes used in blocks.back(), or in lent
+	size_t blockSize = 1 << 20;
+
+	// caller memory (see arenaAttach) used instead of blocks; the arena never grows past it
+	unsigned char* lent = nullptr;
+	size_t lentSize{};
+
+	MemoryAccount* account = nullptr;
+	MemorySubsystem subsystem = GENERATION_MEMORY;
+};
+
+struct ArenaMark {
+	size_t block{}, used{};
+};
+
+// Makes sure the next `bytes` can be allocated without starting another block. False if they
+// don't fit the caller's memory.
+bool arenaReserve(Arena& arena, size_t bytes) {
+	if (arena.lent) return arena.used + bytes <= arena.lentSize;
+	if (!arena.blocks.empty() && arena.used + bytes <= arena.blocks.back().size) return true;
+	size_t size = max(bytes, arena.blockSize);
+	unique_ptr<unsigned char[], ArenaFree> memory(new unsigned char[size], ArenaFree{ arena.account, arena.subsystem, size });
+	charge(arena.account, arena.subsystem, size);
+	arena.blocks.push_back({ move(memory), size });
+	arena.used = 0;
+	return true;
+}
+
+// nullptr once the caller's memory is used up.
+void* arenaAlloc(Arena& arena, size_t bytes, size_t align) {
+	size_t offset = (arena.used + align - 1) & ~(align - 1);
+	if (arena.lent) {
+		if (offset + bytes > arena.lentSize) return nullptr;
+		arena.used = offset + bytes;
+		return arena.lent + offset;
+	}
+	if (arena.blocks.empty() || offset + bytes > arena.blocks.back().size) {
+		if (!arenaReserve(arena, bytes + align)) return nullptr;
+		offset = 0;
+	}
+	arena.used = offset + bytes;
+	return arena.blocks.back().memory.get() + offset;
+}
+
+// Lends the arena `bytes` of caller memory to allocate from instead of its own blocks. The start
+// is aligned for any type, like a block the arena allocates itself.
+void arenaAttach(Arena& arena, void* memory, size_t bytes) {
+	size_t skip = (alignof(max_align_t) - (uintptr_t)memory % alignof(max_align_t)) % alignof(max_align_t);
+	arena.blocks.clear();
+	arena.lent = (unsigned char*)memory + skip;
+	arena.lentSize = bytes > skip ? bytes - skip : 0;
+	arena.used = 0;
+}
+
+ArenaMark arenaMark(const Arena& arena) {
+	return { arena.blocks.size(), arena.used };
+}
+
+void arenaRewind(Arena& arena, ArenaMark mark) {
+	arena.blocks.resize(mark.block);
+	arena.used = mark.used;
+}
+
+// Row-major 2D array in arena memory, indexed grid[row][column] like a vector of rows.
+template <typename T>
+struct Grid {
+	T* cells = nullptr;
+	int sizeX{}, sizeY{}; // row length, row count
+	T* operator[](int y) const { return cells + (size_t)y * sizeX; }
+};
+
+// count value initialized Ts, nullptr once the caller's memory is used up.
+template <typename T>
+T* arenaArray(Arena& arena, size_t count) {
+	T* items = (T*)arenaAlloc(arena, sizeof(T) * count, alignof(T));
+	if (items) uninitialized_fill_n(items, count, T{});
+	return items;
+}
+
+template <typename T>
+Grid<T> arenaGrid(Arena& arena, int sizeX, int sizeY) {
+	Grid<T> grid;
+	grid.sizeX = sizeX;
+	grid.sizeY = sizeY;
+	grid.cells = arenaArray<T>(arena, (size_t)sizeX * sizeY);
+	return grid;
+}
+
 // ----------[ STRUCT ]--------------
 
 enum Tile
@@ -45,32 +427,198 @@ enum Direction
 	SOUTH,
 };
 
+enum Placement
+{
+	LATTICE_PLACEMENT, // one room per roomsX x roomsY cell
+	POISSON_PLACEMENT, // variable sized rooms scattered by Poisson-disk sampling
+	CAVE_PLACEMENT,    // cellular automaton caves, no rooms
+};
+
 struct Room
 {
 	int sizeX{}, sizeY{};
-	int mapX{}, mapY{};
-	int offsetX{}, offsetY{};
-	vector<vector<Tile>> tiles;
+	int mapX{}, mapY{};       // lattice cell, lattice placement only
+	int offsetX{}, offsetY{}; // within the cell, lattice placement only
+	int left{}, top{};        // top left wall tile on the map
+	Direction doors[4]{};
+	int doorX[4]{}, doorY[4]{};
+	int doorCount{};
+
+	static constexpr int minSize = 8;
+	static constexpr int maxSizeX = 12, maxSizeY = 10;
+	static constexpr int maxScatteredSize = 20;
+};
+
+// Rooms by position for scattered placement. Every room is listed in each bucket its rectangle
+// overlaps, buckets are larger than any room, so a room sits in at most four of them. Each bucket
+// is a list of entries in the order they were added, linked through next.
+struct RoomHash {
+	static constexpr int bucketSize = 32;
+	int bucketsX{}, bucketsY{};
+	int* first = nullptr; // per bucket, -1 if empty
+	int* last = nullptr;
+	int* next = nullptr;  // per entry, -1 at the end of a bucket
+	int* room = nullptr;  // per entry, index into Map::rooms
+	int entries{};
+};
+
+// One run of identical tiles in a row, lasting until the next run's x (or the end of the row).
+struct TileRun {
+	unsigned short x{};
+	unsigned char tile{};
+};
+
+// Run-length encoded tile grid, one run list per row. Used at runtime once generation is done.
+struct TileStore {
+	int sizeX{}, sizeY{};
+	vector<vector<TileRun>> rows;
+};
+
+// A light source on a tile, lighting everything within radius tiles with a linear falloff.
+struct Light {
+	int x{}, y{};
+	int radius{};
+	unsigned char intensity{};
+	bool on = false;
+};
+
+// Per tile light level 0-255. Static room torches are baked once, dynamic lights are
+// added on top and only ever relight the tiles within their radius.
+struct LightMap {
+	int sizeX{}, sizeY{};
+	vector<unsigned char> baked;
+	vector<unsigned char> level; // baked + dynamic lights, what rendering reads
+	vector<Light> dynamicLights; // switched off lights are free slots
+};
+
+// Chebyshev distance from every tile to the nearest WALL, capped at maxWallDistance.
+struct DistanceField {
+	int sizeX{}, sizeY{};
+	vector<unsigned char> dist;
+};
+
+// One run of identical labels in a row, lasting until the next run's x (or the end of the row).
+struct LabelRun {
+	unsigned short x{};
+	int label{};
+};
+
+// Per tile labels, see labelRegions, run-length encoded one run list per row like TileStore.
+// noRegion where a tile has none.
+struct RegionMap {
+	int sizeX{}, sizeY{};
+	vector<vector<LabelRun>> region;    // room index, or from roomCount up a patch of corridor
+	vector<vector<LabelRun>> component; // walkable patch
+	vector<int> componentSize; // tiles per component ID, one per ID handed out; merged ones are 0 and not reused
+};
+
+// Zoomed out map pyramid. Level n covers 2^(n+1) x 2^(n+1) tiles per cell and stores the share
+// of them that are walls, 0-255; every level averages 2 x 2 cells of the one below.
+struct OverviewLevel {
+	int sizeX{}, sizeY{};
+	vector<unsigned char> walls;
+};
+
+struct Overview {
+	vector<OverviewLevel> levels; // the last one is a single cell
+};
 
-	int maxSizeX = 12, maxSizeY = 10;
+// A billboard standing on the floor at world position x, y, scale tiles high.
+struct Sprite {
+	float x{}, y{};
+	float scale = 0.5f;
+	char c = '?';
 };
 
+// Sprites by tile, bucketSize x bucketSize tiles per bucket.
+struct SpriteIndex {
+	static constexpr int bucketSize = 8;
+	int bucketsX{}, bucketsY{};
+	vector<vector<int>> buckets; // indices into Map::sprites
+};
+
+// World units per tile. A power of two, so the ray caster finds tiles and grid lines by shifting.
+constexpr int tileShift = 6;
+constexpr int tileSize = 1 << tileShift;
+
 struct Player {
 	float x{}, y{}, deltaX{}, deltaY{}, angle{};
+	int lantern = -1; // dynamic light following the player
+};
+
+// A tile changed after generation. Saves store these instead of the map itself.
+struct TileEdit {
+	unsigned short x{}, y{};
+	unsigned char tile{};
+};
+
+// Everything that decides what a generated floor looks like.
+struct MapParams {
+	unsigned int seed = 2137420;
+	int roomsX = 5, roomsY = 5; // scattered placement fills the same area
+	Placement placement = LATTICE_PLACEMENT;
+	bool verbose = true; // progress messages on cout
+	MemoryAccount* memory = nullptr; // charged with the generation arenas, optional
+	int routingThreads = 0; // corridor searches run in parallel, 0 = one thread per core
+	int caveThreads = 0;    // bands of cave rows smoothed in parallel, 0 = one thread per core
 };
 
+// TileRun and TileEdit keep a coordinate in 16 bits, so no map side is longer. That is the format's
+// limit, not generation's: floors are generated on a dense grid, and every door's corridor search
+// sets up nodes for the whole map (see connectRooms), so floors with rooms take time growing with
+// about the square of their area. On one thread 40x40 lattice rooms take some 17 s, scattered ones
+// some 3 s; caves search nothing and get to 1000x1000 rooms in some 12 s and 0.8 GB at peak.
+const int maxMapSide = 65535;
+
+// At least one room cell each way and no side longer than maxMapSide.
+constexpr bool mapSizeValid(const MapParams& params) {
+	return params.roomsX >= 1 && params.roomsY >= 1 &&
+		params.roomsX <= maxMapSide / Room::maxSizeX && params.roomsY <= maxMapSide / Room::maxSizeY;
+}
+
 struct Map {
 	int roomsX = 5, roomsY = 5;
+	unsigned int seed = 2137420;
+	Placement placement = LATTICE_PLACEMENT;
+	bool verbose = true;
+	MemoryAccount* memory = nullptr;
+	int routingThreads = 0;
+	int caveThreads = 0;
 
 	int sizeX{}, sizeY{};
-	int tileSize = 64;
 
 	Player player;
 
-	vector<vector<Room>> roomArray;
-	vector<vector<Tile>> tileArray;
+	Room* rooms = nullptr; // row by row for lattice placement, in placement order for scattered
+	int roomCount{}, roomCapacity{};
+	RoomHash roomHash;     // scattered placement only
+	Arena roomArena;       // rooms and room hash, unless the caller provides them
+	TileStore tiles;
+	LightMap lights;
+	DistanceField wallDistance;
+	Overview overview;
+	RegionMap regions;
+	vector<Sprite> sprites;
+	SpriteIndex spriteIndex;
+	vector<TileEdit> edits; // every changeTile since generation, in order
+
+	// generation only: the dense grid and what routing the corridors keeps, released together once the map is compressed
+	Arena arena;
+	Grid<Tile> tileArray;
+};
+
+// Every room of the floor, for range-for.
+struct RoomRange {
+	const Room* first;
+	const Room* last;
+	const Room* begin() const { return first; }
+	const Room* end() const { return last; }
 };
 
+RoomRange allRooms(const Map& map) {
+	return { map.rooms, map.rooms + map.roomCount };
+}
+
 // ----------[ RANDOM FUNCTIONS ]--------------
 
 void cls() {
@@ -95,637 +643,3319 @@ float dist(int x1, int y1, int x2, int y2) {
 	return (float)sqrt(pow(x1 - x2, 2) + pow(y1 - y2, 2));
 }
 
-int randInt(int min, int max)
-{
-	return (int)(rand() % (max - min)) + min;
+// Threads for `work` independent pieces: as requested, one per core if 0, never more than pieces.
+int threadCount(int requested, size_t work) {
+	int threads = requested > 0 ? requested : (int)max(1u, thread::hardware_concurrency());
+	return max(1, (int)min((size_t)threads, work));
 }
 
-Direction randDirection(unsigned int seed)
-{
-	srand(seed);
-	const Direction allDir[4] = { NORTH, WEST, EAST, SOUTH };
-	return allDir[randInt(0, 4)];
+// Index of the lowest set bit, bits must not be 0.
+int lowestBit(uint64_t bits) {
+#if defined(_WIN32)
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return (int)index;
+#else
+	return __builtin_ctzll(bits);
+#endif // Windows
 }
 
-unsigned int getSeed(int x, int y, unsigned int globalSeed = 2137420)
+// Counter-based generator: draw n of a stream is a hash of the stream's key and n, so any value
+// for any room or tile is computed on its own in O(1) and nothing is shared between calls or
+// threads. The hash is SplitMix64; keys mix the floor seed, a position (a lattice cell, a room
+// index or a tile) and what the draws are for, so mirrored positions like (1, 2) and (2, 1) get
+// unrelated streams.
+
+enum RandomStream
 {
-	return (unsigned int)x + y + 420 * 2137 * 69 * globalSeed;
-}
+	ROOM_STREAM,    // lattice room size and offset
+	DOOR_STREAM,    // door count, walls and positions
+	SCATTER_STREAM, // Poisson-disk placement
+	CAVE_STREAM,    // initial cave walls, one stream per row drawn at x
+};
 
-// ----------[ VIEW ]--------------
+uint64_t mixBits(uint64_t z) {
+	z += 0x9e3779b97f4a7c15ull;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
 
-struct view {
-	int sizeX{}, sizeY{};
-	bool map = false;
-	vector<vector<char>> viewArray;
+// A stream and the index of its next draw.
+struct Random {
+	uint64_t key{};
+	uint64_t counter{};
 };
 
-view createView() {
-	view v;
-	getTerminalSize(v.sizeX, v.sizeY);
-	for (int y = 0; y < v.sizeX; y++) {
-		vector<char> temp;
-		for (int x = 0; x < v.sizeX; x++)
-			temp.push_back(' ');
-		v.viewArray.push_back(temp);
-	}
-	return v;
+Random randomStream(unsigned int seed, int x, int y, RandomStream stream) {
+	Random random;
+	random.key = mixBits(mixBits(mixBits(seed) ^ ((uint64_t)(uint32_t)x << 32 | (uint32_t)y)) ^ stream);
+	return random;
 }
 
-void clearView(view& v) {
-	for (int y = 0; y < v.sizeY; y++)
-		for (int x = 0; x < v.sizeX; x++)
-			v.viewArray[y][x] = ' ';
+// Draw n of the stream, whatever has been drawn from it so far.
+uint32_t randomAt(const Random& random, uint64_t n) {
+	return (uint32_t)(mixBits(random.key + n * 0x9e3779b97f4a7c15ull) >> 32);
 }
 
-void renderView(view v) {
-	cls();
-	for (int y = 0; y < v.sizeY; y++) {
-		for (int x = 0; x < v.sizeX; x++)
-		{
-			cout.width(2);
-			cout << v.viewArray[y][x];
-		}
-		cout << endl;
-	}
+uint32_t nextRandom(Random& random) {
+	return randomAt(random, random.counter++);
 }
 
-void placeWall(view& v, int x, int y, int height, char c) {
-	if (x < 0 || y < 0 || x >= v.sizeX || y >= v.sizeY) return;
-	for (int h = 0; h < height; h++)
-		if (y + h < v.sizeY)
-			v.viewArray[y + h][x] = c;
+// Multiply-shift instead of a modulo, so small ranges come out even too.
+int randInt(Random& random, int min, int max)
+{
+	return min + (int)(((uint64_t)nextRandom(random) * (uint32_t)(max - min)) >> 32);
 }
 
-char stateToChar(Tile s)
+Direction randDirection(Random& random)
 {
-	switch (s)
-	{
-	case WALL:
-	case CORRIDOR_WALL:
-		return '#';
-	case UNDESTRUCT_WALL:
-		return 'W';
-	case AIR:
-	default:
-		return ' ';
+	const Direction allDir[4] = { NORTH, WEST, EAST, SOUTH };
+	return allDir[randInt(random, 0, 4)];
+}
+
+// ----------[ TILE STORE ]--------------
+
+vector<TileRun> compressRow(const Tile* row, int sizeX) {
+	vector<TileRun> runs;
+	for (int x = 0; x < sizeX; x++)
+		if (runs.empty() || runs.back().tile != row[x])
+			runs.push_back({ (unsigned short)x, (unsigned char)row[x] });
+	runs.shrink_to_fit();
+	return runs;
+}
+
+void expandRow(const vector<TileRun>& runs, Tile* row, int sizeX) {
+	for (size_t i = 0; i < runs.size(); i++) {
+		int end = i + 1 < runs.size() ? runs[i + 1].x : sizeX;
+		for (int x = runs[i].x; x < end; x++)
+			row[x] = (Tile)runs[i].tile;
 	}
 }
 
-void viewMap2D(view& v, Map& map)
-{
-	Room r;
-	int mapPlayerX = (int)(map.player.x / map.tileSize);
-	int mapPlayerY = (int)(map.player.y / map.tileSize);
+TileStore compressTiles(const Grid<Tile>& dense) {
+	TileStore store;
+	store.sizeX = dense.sizeX;
+	store.sizeY = dense.sizeY;
+	store.rows.resize(store.sizeY);
+	for (int y = 0; y < store.sizeY; y++)
+		store.rows[y] = compressRow(dense[y], store.sizeX);
+	return store;
+}
 
-	int view0X = mapPlayerX - v.sizeX / 2;
-	int view0Y = mapPlayerY - v.sizeY / 2;
+// Fills a caller-provided dense grid of the store's size.
+void decompressTiles(const TileStore& store, const Grid<Tile>& dense) {
+	for (int y = 0; y < store.sizeY; y++)
+		expandRow(store.rows[y], dense[y], store.sizeX);
+}
 
+Tile getTile(const TileStore& store, int x, int y) {
+	const vector<TileRun>& row = store.rows[y];
+	auto it = upper_bound(row.begin(), row.end(), x, [](int x, const TileRun& run) { return x < run.x; });
+	return (Tile)(it - 1)->tile;
+}
 
-	if (view0X < 0) view0X = 0;
-	if (view0Y < 0) view0Y = 0;
-	if (view0X + v.sizeX >= map.sizeX) view0X = map.sizeX - v.sizeX;
-	if (view0Y + v.sizeY >= map.sizeY) view0Y = map.sizeY - v.sizeY;
+// Splits the run holding x around it and merges the new run with equal neighbours, the rest of
+// the row is only shifted.
+void setTile(TileStore& store, int x, int y, Tile tile) {
+	vector<TileRun>& row = store.rows[y];
+	size_t i = upper_bound(row.begin(), row.end(), x, [](int x, const TileRun& run) { return x < run.x; }) - row.begin() - 1;
+	TileRun old = row[i];
+	if (old.tile == tile) return;
+	int end = i + 1 < row.size() ? row[i + 1].x : store.sizeX;
+
+	TileRun pieces[3];
+	int count = 0;
+	if (x > old.x) pieces[count++] = old;
+	size_t at = i + count;
+	pieces[count++] = { (unsigned short)x, (unsigned char)tile };
+	if (x + 1 < end) pieces[count++] = { (unsigned short)(x + 1), old.tile };
+	row[i] = pieces[0];
+	row.insert(row.begin() + i + 1, pieces + 1, pieces + count);
+
+	if (at + 1 < row.size() && row[at + 1].tile == tile) row.erase(row.begin() + at + 1);
+	if (at > 0 && row[at - 1].tile == tile) row.erase(row.begin() + at);
+}
 
-	cls();
-	for (int y = view0Y; y < view0Y + v.sizeY; y++)
-	{
-		for (int x = view0X; x < view0X + v.sizeX; x++)
-		{
-			cout.width(2);
-			if (mapPlayerX == x && mapPlayerY == y) { cout << "P"; continue; }
-			cout << stateToChar(map.tileArray[y][x]);
-			// cout << map.tileArray[x][y];
-		}
-		cout << endl;
+// Calls f(fromX, toX, tile) for every run of row y overlapping [fromX, toX), clipped to that range.
+template <typename F>
+void forEachSpan(const TileStore& store, int y, int fromX, int toX, F f) {
+	const vector<TileRun>& row = store.rows[y];
+	auto it = upper_bound(row.begin(), row.end(), fromX, [](int x, const TileRun& run) { return x < run.x; }) - 1;
+	for (; it != row.end() && it->x < toX; it++) {
+		int end = it + 1 != row.end() ? (it + 1)->x : store.sizeX;
+		f(max((int)it->x, fromX), min(end, toX), (Tile)it->tile);
 	}
 }
 
-// ----------[ MAP ]--------------
-
-Room generateRandomRoom(int x, int y)
-{
-	unsigned int roomSeed = getSeed(x, y);
-	Room randRoom;
-	srand(roomSeed);
+// ----------[ DISTANCE FIELD ]--------------
+// Lets rays jump over open space. Values are capped, so each one only depends on the walls
+// within maxWallDistance of its tile and a changed tile only needs the square around it redone.
+
+const int maxWallDistance = 16;
+
+// Recomputes the field inside [x0, x1] x [y0, y1] with a two pass chamfer over that box
+// grown by maxWallDistance, which holds every wall the values inside can see.
+void computeDistanceRegion(const TileStore& tiles, DistanceField& field, int x0, int y0, int x1, int y1) {
+	x0 = max(x0, 0); y0 = max(y0, 0);
+	x1 = min(x1, field.sizeX - 1); y1 = min(y1, field.sizeY - 1);
+	if (x0 > x1 || y0 > y1) return;
+	int bx0 = max(x0 - maxWallDistance, 0), by0 = max(y0 - maxWallDistance, 0);
+	int bx1 = min(x1 + maxWallDistance, field.sizeX - 1), by1 = min(y1 + maxWallDistance, field.sizeY - 1);
+	int w = bx1 - bx0 + 1, h = by1 - by0 + 1;
+
+	vector<unsigned char> box((size_t)w * h, maxWallDistance);
+	for (int y = by0; y <= by1; y++)
+		forEachSpan(tiles, y, bx0, bx1 + 1, [&](int fromX, int toX, Tile tile) {
+			if (tile == WALL) memset(&box[(size_t)(y - by0) * w + fromX - bx0], 0, toX - fromX);
+		});
+
+	auto relax = [&](unsigned char& d, int x, int y) {
+		if (x < 0 || y < 0 || x >= w || y >= h) return;
+		d = min<int>(d, box[(size_t)y * w + x] + 1);
+	};
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++) {
+			unsigned char& d = box[(size_t)y * w + x];
+			relax(d, x - 1, y - 1); relax(d, x, y - 1); relax(d, x + 1, y - 1); relax(d, x - 1, y);
+		}
+	for (int y = h - 1; y >= 0; y--)
+		for (int x = w - 1; x >= 0; x--) {
+			unsigned char& d = box[(size_t)y * w + x];
+			relax(d, x + 1, y + 1); relax(d, x, y + 1); relax(d, x - 1, y + 1); relax(d, x + 1, y);
+		}
 
-	randRoom.mapX = x;
-	randRoom.mapY = y;
+	for (int y = y0; y <= y1; y++)
+		memcpy(&field.dist[(size_t)y * field.sizeX + x0], &box[(size_t)(y - by0) * w + x0 - bx0], x1 - x0 + 1);
+}
 
-	randRoom.sizeX = randInt(8, randRoom.maxSizeX);
-	randRoom.sizeY = randInt(8, randRoom.maxSizeY);
+void buildDistanceField(Map& map) {
+	map.wallDistance.sizeX = map.sizeX;
+	map.wallDistance.sizeY = map.sizeY;
+	map.wallDistance.dist.assign((size_t)map.sizeX * map.sizeY, 0);
+	computeDistanceRegion(map.tiles, map.wallDistance, 0, 0, map.sizeX - 1, map.sizeY - 1);
+}
 
-	randRoom.offsetX = randInt(0, randRoom.maxSizeX - randRoom.sizeX);
-	randRoom.offsetY = randInt(0, randRoom.maxSizeY - randRoom.sizeY);
+// Call after the tile at (x, y) changed.
+void updateDistanceField(Map& map, int x, int y) {
+	computeDistanceRegion(map.tiles, map.wallDistance, x - maxWallDistance, y - maxWallDistance, x + maxWallDistance, y + maxWallDistance);
+}
 
-	for (int y = 0; y < randRoom.maxSizeY; y++)
-	{
-		vector<Tile> temp;
-		for (int x = 0; x < randRoom.maxSizeX; x++)
-		{
-			Tile tile = AIR;
+// Grid crossings per tile travelled across a ray's stepping axis, in 1/65536ths, for a ray that
+// moves `step` world units across it per crossing. Rounded down, so leaps stay short of a wall.
+int crossingsPerTile(float step) {
+	float perTile = tileSize / fabs(step);
+	// also catches the 0 step and the infinite or NaN one of an axis-aligned ray
+	if (!(perTile > 0 && perTile < maxWallDistance)) perTile = perTile > 0 ? maxWallDistance : 0;
+	return max((int)(perTile * 65536) - 1, 0);
+}
 
-			if (
-				(x == randRoom.offsetX && y < randRoom.sizeY + randRoom.offsetY && y >= randRoom.offsetY)
-				|| (x == randRoom.sizeX + randRoom.offsetX - 1 && y < randRoom.sizeY + randRoom.offsetY && y> randRoom.offsetY)
-				|| (y == randRoom.offsetY && x < randRoom.sizeX + randRoom.offsetX && x >= randRoom.offsetX)
-				|| (y == randRoom.sizeY + randRoom.offsetY - 1 && x < randRoom.sizeX + randRoom.offsetX && x> randRoom.offsetX)
-				)
-				tile = WALL;
-			if (x > randRoom.offsetX && x < randRoom.sizeX + randRoom.offsetX - 1 && y > randRoom.offsetY && y < randRoom.sizeY + randRoom.offsetY - 1)
-				tile = ROOM_AIR;
+// How many grid crossings a ray can take from a tile d away from the nearest wall, the first
+// included, without passing one: every crossing moves one tile along the stepping axis and
+// 1 / perTile tiles along the other one, and both have to stay under d - 1 tiles. Close to a wall
+// the leap would be a crossing or two anyway, and single crossings are cheaper to take than to work out.
+int rayLeap(int d, int perTile) {
+	return d <= 3 ? 1 : 1 + min(d - 1, (d - 1) * perTile >> 16);
+}
 
-			temp.push_back(tile);
+// ----------[ OVERVIEW ]--------------
+
+// Average of the (up to) 2 x 2 cells of level below covering cell (x, y), cells past the edge don't count.
+unsigned char summarizeCell(const OverviewLevel& below, int x, int y) {
+	int sum = 0, count = 0;
+	for (int dy = 0; dy < 2; dy++)
+		for (int dx = 0; dx < 2; dx++) {
+			int cX = x * 2 + dx, cY = y * 2 + dy;
+			if (cX >= below.sizeX || cY >= below.sizeY) continue;
+			sum += below.walls[(size_t)cY * below.sizeX + cX];
+			count++;
 		}
-		randRoom.tiles.push_back(temp);
-	}
-
-	for (int i = 0; i < roomSeed % 3 + 2; i++)
-	{
-		Direction randDir = randDirection(roomSeed + i);
-		if (randDir == NORTH)
-			randRoom.tiles[randRoom.offsetY][randInt(1 + randRoom.offsetX, randRoom.sizeX + randRoom.offsetX - 2)] = DOOR;
-		if (randDir == SOUTH)
-			randRoom.tiles[randRoom.sizeY + randRoom.offsetY - 1][randInt(1 + randRoom.offsetX, randRoom.sizeX + randRoom.offsetX - 2)] = DOOR;
-		if (randDir == WEST)
-			randRoom.tiles[randInt(1 + randRoom.offsetY, randRoom.sizeY + randRoom.offsetY - 2)][randRoom.offsetX] = DOOR;
-		if (randDir == EAST)
-			randRoom.tiles[randInt(1 + randRoom.offsetY, randRoom.sizeY + randRoom.offsetY - 2)][randRoom.sizeX + randRoom.offsetX - 1] = DOOR;
-	}
+	return (unsigned char)(sum / count);
+}
 
-	return randRoom;
+unsigned char summarizeTiles(const TileStore& tiles, int x, int y) {
+	int sum = 0, count = 0;
+	for (int tY = y * 2; tY < min(y * 2 + 2, tiles.sizeY); tY++)
+		for (int tX = x * 2; tX < min(x * 2 + 2, tiles.sizeX); tX++) {
+			sum += getTile(tiles, tX, tY) == WALL ? 255 : 0;
+			count++;
+		}
+	return (unsigned char)(sum / count);
 }
 
-Map generateMap() {
-	Map map;
-	cout << "Generating map..." << endl;
-	Room r;
-	map.sizeX = map.roomsX * r.maxSizeX;
-	map.sizeY = map.roomsY * r.maxSizeY;
-	for (int y = 0; y < map.sizeY; y++) {
-		vector<Tile> temp;
-		for (int x = 0; x < map.sizeX; x++) {
-			Tile state = AIR;
-			if (x == 0 || x == map.sizeX - 1 || y == 0 || y == map.sizeY - 1)
-				state = UNDESTRUCT_WALL;
-			temp.push_back(state);
+void buildOverview(Map& map) {
+	vector<OverviewLevel>& levels = map.overview.levels;
+	levels.clear();
+	OverviewLevel first;
+	first.sizeX = (map.sizeX + 1) / 2;
+	first.sizeY = (map.sizeY + 1) / 2;
+	first.walls.assign((size_t)first.sizeX * first.sizeY, 0);
+	// walls are counted straight from the runs, then turned into shares like summarizeTiles does
+	vector<int> counts(first.walls.size(), 0);
+	for (int y = 0; y < map.sizeY; y++)
+		forEachSpan(map.tiles, y, 0, map.sizeX, [&](int fromX, int toX, Tile tile) {
+			if (tile != WALL) return;
+			for (int x = fromX; x < toX; x++)
+				counts[(size_t)(y / 2) * first.sizeX + x / 2]++;
+		});
+	for (int y = 0; y < first.sizeY; y++)
+		for (int x = 0; x < first.sizeX; x++) {
+			int tiles = (min(x * 2 + 2, map.sizeX) - x * 2) * (min(y * 2 + 2, map.sizeY) - y * 2);
+			first.walls[(size_t)y * first.sizeX + x] = (unsigned char)(counts[(size_t)y * first.sizeX + x] * 255 / tiles);
 		}
-		map.tileArray.push_back(temp);
+	levels.push_back(move(first));
+
+	while (levels.back().sizeX > 1 || levels.back().sizeY > 1) {
+		const OverviewLevel& below = levels.back();
+		OverviewLevel level;
+		level.sizeX = (below.sizeX + 1) / 2;
+		level.sizeY = (below.sizeY + 1) / 2;
+		level.walls.resize((size_t)level.sizeX * level.sizeY);
+		for (int y = 0; y < level.sizeY; y++)
+			for (int x = 0; x < level.sizeX; x++)
+				level.walls[(size_t)y * level.sizeX + x] = summarizeCell(below, x, y);
+		levels.push_back(move(level));
 	}
+}
 
-	cout << "Creating rooms..." << endl;
-	for (int y = 0; y < map.roomsY; y++) {
-		vector<Room> temp;
-		for (int x = 0; x < map.roomsX; x++) {
-			Room room = generateRandomRoom(x, y);
-
-			int mapX = room.mapX * room.maxSizeX;
-			int mapY = room.mapY * room.maxSizeY;
-
-			for (int rY = 0; rY < room.maxSizeY; rY++)
-				for (int rX = 0; rX < room.maxSizeX; rX++)
-					if (map.tileArray[mapY + rY][mapX + rX] != UNDESTRUCT_WALL)
-						map.tileArray[mapY + rY][mapX + rX] = room.tiles[rY][rX];
-
-			temp.push_back(room);
-		}
-		map.roomArray.push_back(temp);
+// After tile (x, y) changed: one cell per level, bottom up.
+void updateOverview(Map& map, int x, int y) {
+	vector<OverviewLevel>& levels = map.overview.levels;
+	if (levels.empty()) return;
+	x /= 2; y /= 2;
+	levels[0].walls[(size_t)y * levels[0].sizeX + x] = summarizeTiles(map.tiles, x, y);
+	for (size_t n = 1; n < levels.size(); n++) {
+		x /= 2; y /= 2;
+		levels[n].walls[(size_t)y * levels[n].sizeX + x] = summarizeCell(levels[n - 1], x, y);
 	}
+}
 
+// ----------[ REGIONS ]--------------
+// Labels that make "which room is this tile in" and "can one tile be walked to from the other" a
+// lookup each. Regions are the floor as generated: a room's rectangle, walls included, carries
+// the room's index and every 4-connected patch of corridor outside the rooms an ID from roomCount
+// up. Components follow digging and building: every walkable tile carries the ID of the
+// 4-connected patch of walkable tiles it belongs to.
+
+const int noRegion = -1;
+
+// Labels `start` and everything reachable from it through tiles `joins` accepts. Tiles are
+// labelled as they are pushed, so joins has to turn labelled ones down and the stack never holds
+// more than sizeX * sizeY. Returns how many tiles it labelled.
+template <typename F>
+int floodComponent(int* labels, int* stack, int sizeX, int sizeY, bool diagonal, int start, int label, F joins) {
+	int top = 0, count = 1;
+	labels[start] = label;
+	stack[top++] = start;
+	while (top > 0) {
+		int tile = stack[--top];
+		int x = tile % sizeX, y = tile / sizeX;
+		for (int dy = -1; dy <= 1; dy++)
+			for (int dx = -1; dx <= 1; dx++) {
+				if ((dx == 0 && dy == 0) || (dx != 0 && dy != 0 && !diagonal)) continue;
+				int nX = x + dx, nY = y + dy;
+				if (nX < 0 || nY < 0 || nX >= sizeX || nY >= sizeY || !joins(nX, nY)) continue;
+				labels[nY * sizeX + nX] = label;
+				stack[top++] = nY * sizeX + nX;
+				count++;
+			}
+	}
+	return count;
+}
 
-	Room centerRoom = map.roomArray[map.roomsY / 2][map.roomsX / 2];
-	map.player.x = (centerRoom.mapX * r.maxSizeX + centerRoom.sizeX / 2) * map.tileSize;
-	map.player.y = (centerRoom.mapY * r.maxSizeY + centerRoom.sizeY / 2) * map.tileSize;
+// Gives every unlabelled tile `inside` accepts the label of the patch of them it lies in, counting
+// up from `label`, and returns the next unused one. Patches are 4-connected, or 8-connected with
+// `diagonal`. stack has to hold sizeX * sizeY tiles.
+template <typename F>
+int labelComponents(int* labels, int* stack, int sizeX, int sizeY, bool diagonal, int label, F inside) {
+	auto joins = [&](int x, int y) { return labels[y * sizeX + x] == noRegion && inside(x, y); };
+	for (int y = 0; y < sizeY; y++)
+		for (int x = 0; x < sizeX; x++)
+			if (joins(x, y)) floodComponent(labels, stack, sizeX, sizeY, diagonal, y * sizeX + x, label++, joins);
+	return label;
+}
 
-	return map;
+// What normalizeTiles keeps as AIR.
+bool isWalkable(Tile tile) {
+	return tile != WALL && tile != CORRIDOR_WALL && tile != UNDESTRUCT_WALL;
 }
 
-void normalizeTiles(Map& map) {
-	for (int y = 0; y < map.sizeY; y++)
-		for (int x = 0; x < map.sizeX; x++)
-		{
-			if (map.tileArray[y][x] == CORRIDOR_WALL || map.tileArray[y][x] == UNDESTRUCT_WALL || map.tileArray[y][x] == WALL)
-				map.tileArray[y][x] = WALL;
-			else
-				map.tileArray[y][x] = AIR;
-		}
+// The run of a label row holding x.
+size_t findLabelRun(const vector<LabelRun>& row, int x) {
+	return upper_bound(row.begin(), row.end(), x, [](int x, const LabelRun& run) { return x < run.x; }) - row.begin() - 1;
 }
 
-Room* getRoomFromMapCoords(Map& map, int x, int y) {
-	Room r;
-	return &map.roomArray[(int)y / r.maxSizeY][(int)x / r.maxSizeX];
+// Where run i of a label row ends, the next run's x or the end of the row.
+int labelRunEnd(const vector<LabelRun>& row, size_t i, int sizeX) {
+	return i + 1 < row.size() ? row[i + 1].x : sizeX;
 }
 
-Tile getTileFromPlayerCoords(Map& map, int x, int y) {
-	int mapPlayerX = (int)(x / map.tileSize);
-	int mapPlayerY = (int)(y / map.tileSize);
-	return map.tileArray[mapPlayerY][mapPlayerX];
+vector<LabelRun> compressLabels(const int* row, int sizeX) {
+	vector<LabelRun> runs;
+	for (int x = 0; x < sizeX; x++)
+		if (runs.empty() || runs.back().label != row[x])
+			runs.push_back({ (unsigned short)x, row[x] });
+	runs.shrink_to_fit();
+	return runs;
 }
 
-// ----------[ PATHFINDING ]--------------
+void expandLabels(const vector<LabelRun>& runs, int* row, int sizeX) {
+	for (size_t i = 0; i < runs.size(); i++)
+		fill(row + runs[i].x, row + labelRunEnd(runs, i, sizeX), runs[i].label);
+}
 
+int getLabel(const vector<vector<LabelRun>>& rows, int x, int y) {
+	const vector<LabelRun>& row = rows[y];
+	return row[findLabelRun(row, x)].label;
+}
 
-// A*
-// https://dev.to/jansonsa/a-star-a-path-finding-c-4a4h
+// Like setTile: splits the run holding x around it and merges the new run with equal neighbours.
+void setLabel(vector<vector<LabelRun>>& rows, int sizeX, int x, int y, int label) {
+	vector<LabelRun>& row = rows[y];
+	size_t i = findLabelRun(row, x);
+	LabelRun old = row[i];
+	if (old.label == label) return;
+	int end = labelRunEnd(row, i, sizeX);
+
+	LabelRun pieces[3];
+	int count = 0;
+	if (x > old.x) pieces[count++] = old;
+	size_t at = i + count;
+	pieces[count++] = { (unsigned short)x, label };
+	if (x + 1 < end) pieces[count++] = { (unsigned short)(x + 1), old.label };
+	row[i] = pieces[0];
+	row.insert(row.begin() + i + 1, pieces + 1, pieces + count);
+
+	if (at + 1 < row.size() && row[at + 1].label == label) row.erase(row.begin() + at + 1);
+	if (at > 0 && row[at - 1].label == label) row.erase(row.begin() + at);
+}
 
-struct Node {
-	int x, y;
-	int parentX = -1, parentY = -1;
-	float gCost = FLT_MAX, hCost = FLT_MAX, fCost = FLT_MAX;
+// A run of tiles a labelling takes in, [start, end) of one row, and its union-find parent.
+struct PatchRun {
+	int start{}, end{};
+	int parent{};
 };
 
-inline bool operator < (const Node& lhs, const Node& rhs)
-{
-	return lhs.fCost < rhs.fCost;
+int findPatch(vector<PatchRun>& runs, int run) {
+	while (runs[run].parent != run) {
+		runs[run].parent = runs[runs[run].parent].parent;
+		run = runs[run].parent;
+	}
+	return run;
 }
 
-Node findClosestDoor(Map& map, int sX, int sY) {
-	Node closest;
-	closest.x = sX;
-	closest.y = sY;
-	float closestDist = FLT_MAX;
+// Gives every tile `inside` accepts the label of the 4-connected patch of them it lies in, counting
+// up from `label` in the order labelComponents hands them out, and returns the next unused one.
+// Patches are joined run by run like keepLargestCave does, so nothing is kept per tile.
+template <typename F>
+int labelRuns(vector<vector<LabelRun>>& rows, int sizeX, int sizeY, int label, F inside) {
+	vector<PatchRun> runs;
+	vector<int> rowFirst(sizeY + 1);
+	for (int y = 0; y < sizeY; y++) {
+		rowFirst[y] = (int)runs.size();
+		for (int x = 0; x < sizeX; x++) {
+			if (!inside(x, y)) continue;
+			int start = x;
+			while (x < sizeX && inside(x, y)) x++;
+			runs.push_back({ start, x, (int)runs.size() });
+		}
+	}
+	rowFirst[sizeY] = (int)runs.size();
+
+	// join every run with the overlapping runs of the row above, both rows sorted by x; a patch's
+	// root stays its first run, which is where labelComponents would start flooding it
+	for (int y = 1; y < sizeY; y++) {
+		int above = rowFirst[y - 1], run = rowFirst[y];
+		while (above < rowFirst[y] && run < rowFirst[y + 1]) {
+			if (runs[above].start < runs[run].end && runs[run].start < runs[above].end) {
+				int a = findPatch(runs, above), b = findPatch(runs, run);
+				if (a != b) runs[max(a, b)].parent = min(a, b);
+			}
+			if (runs[above].end < runs[run].end) above++;
+			else run++;
+		}
+	}
+
+	vector<int> labels(runs.size());
+	rows.assign(sizeY, {});
+	for (int y = 0; y < sizeY; y++) {
+		vector<LabelRun>& row = rows[y];
+		int x = 0;
+		for (int run = rowFirst[y]; run < rowFirst[y + 1]; run++) {
+			int root = findPatch(runs, run);
+			labels[run] = root == run ? label++ : labels[root];
+			if (runs[run].start > x) row.push_back({ (unsigned short)x, noRegion });
+			row.push_back({ (unsigned short)runs[run].start, labels[run] });
+			x = runs[run].end;
+		}
+		if (x < sizeX) row.push_back({ (unsigned short)x, noRegion });
+		row.shrink_to_fit();
+	}
+	return label;
+}
+
+// Moves row y's run i, and every run 4-connected to it that has the same label, to label. Returns
+// how many tiles it moved. The stack only ever holds runs, so it is allocated per call.
+int relabelPatch(vector<vector<LabelRun>>& rows, int sizeX, int y, size_t i, int label) {
+	int from = rows[y][i].label, moved = 0;
+	vector<pair<int, size_t>> stack = { { y, i } };
+	rows[y][i].label = label;
+	while (!stack.empty()) {
+		int runY = stack.back().first;
+		size_t run = stack.back().second;
+		stack.pop_back();
+		int start = rows[runY][run].x, end = labelRunEnd(rows[runY], run, sizeX);
+		moved += end - start;
+		for (int nY = runY - 1; nY <= runY + 1; nY += 2) {
+			if (nY < 0 || nY >= (int)rows.size()) continue;
+			vector<LabelRun>& row = rows[nY];
+			for (size_t n = findLabelRun(row, start); n < row.size() && row[n].x < end; n++)
+				if (row[n].label == from) {
+					row[n].label = label;
+					stack.push_back({ nY, n });
+				}
+		}
+	}
+	return moved;
+}
+
+// From the dense grid before normalizeTiles, while room floors and corridors are still apart.
+void labelRegions(Map& map) {
+	RegionMap& regions = map.regions;
+	regions.sizeX = map.sizeX;
+	regions.sizeY = map.sizeY;
+	// the rooms' rectangles, walls included, one row at a time; where two overlap the later one wins
+	vector<vector<int>> rowRooms(map.sizeY);
+	for (int r = 0; r < map.roomCount; r++)
+		for (int y = map.rooms[r].top; y < map.rooms[r].top + map.rooms[r].sizeY; y++)
+			rowRooms[y].push_back(r);
+	vector<int> row(map.sizeX);
+	auto fillRooms = [&](int y) {
+		for (int r : rowRooms[y])
+			fill_n(&row[map.rooms[r].left], map.rooms[r].sizeX, r);
+	};
+	vector<vector<LabelRun>> rooms(map.sizeY);
+	for (int y = 0; y < map.sizeY; y++) {
+		fill(row.begin(), row.end(), noRegion);
+		fillRooms(y);
+		rooms[y] = compressLabels(row.data(), map.sizeX);
+	}
+
+	const Grid<Tile>& tiles = map.tileArray;
+	vector<vector<LabelRun>>& region = regions.region;
+	labelRuns(region, map.sizeX, map.sizeY, map.roomCount,
+		[&](int x, int y) { return tiles[y][x] == ROOM_AIR && getLabel(rooms, x, y) == noRegion; });
+	for (int y = 0; y < map.sizeY; y++) {
+		expandLabels(region[y], row.data(), map.sizeX);
+		fillRooms(y);
+		region[y] = compressLabels(row.data(), map.sizeX);
+	}
+
+	int components = labelRuns(regions.component, map.sizeX, map.sizeY, 0,
+		[&](int x, int y) { return isWalkable(tiles[y][x]); });
+	regions.componentSize.assign(components, 0);
+	for (const vector<LabelRun>& runs : regions.component)
+		for (size_t i = 0; i < runs.size(); i++)
+			if (runs[i].label != noRegion) regions.componentSize[runs[i].label] += labelRunEnd(runs, i, map.sizeX) - runs[i].x;
+}
+
+// Call after the tile at (x, y) changed. Digging joins the patches around the tile under the ID
+// of the largest, so only the smaller ones are flooded. Building can split a patch: unless the
+// walkable tiles around it still touch one another, every one of them but the first floods what
+// it can reach with a new ID.
+void updateRegions(Map& map, int x, int y) {
+	RegionMap& regions = map.regions;
+	if (regions.component.empty()) return;
+	vector<vector<LabelRun>>& labels = regions.component;
+	int sizeX = regions.sizeX, sizeY = regions.sizeY;
+	auto labelAt = [&](int tX, int tY) {
+		return tX < 0 || tY < 0 || tX >= sizeX || tY >= sizeY ? noRegion : getLabel(labels, tX, tY);
+	};
+	vector<int>& sizes = regions.componentSize;
+	// moves the patch holding (tX, tY) to label
+	auto relabel = [&](int tX, int tY, int label) {
+		int from = labelAt(tX, tY);
+		int moved = relabelPatch(labels, sizeX, tY, findLabelRun(labels[tY], tX), label);
+		sizes[from] -= moved;
+		sizes[label] += moved;
+	};
+	// the ring around the tile, clockwise from north; even entries are the four neighbours
+	const int ringX[] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+	const int ringY[] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+
+	if (getTile(map.tiles, x, y) != WALL) {
+		if (labelAt(x, y) != noRegion) return;
+		int label = noRegion;
+		for (int i = 0; i < 8; i += 2) {
+			int neighbour = labelAt(x + ringX[i], y + ringY[i]);
+			if (neighbour != noRegion && (label == noRegion || sizes[neighbour] > sizes[label])) label = neighbour;
+		}
+		for (int i = 0; i < 8; i += 2) {
+			int neighbour = labelAt(x + ringX[i], y + ringY[i]);
+			if (neighbour != noRegion && neighbour != label) relabel(x + ringX[i], y + ringY[i], label);
+		}
+		if (label == noRegion) {
+			label = (int)sizes.size();
+			sizes.push_back(0);
+		}
+		setLabel(labels, sizeX, x, y, label);
+		sizes[label]++;
+		return;
+	}
+
+	int old = labelAt(x, y);
+	setLabel(labels, sizeX, x, y, noRegion);
+	if (old == noRegion) return;
+	sizes[old]--;
+	bool open[8];
+	for (int i = 0; i < 8; i++) open[i] = labelAt(x + ringX[i], y + ringY[i]) != noRegion;
+	int neighbours = 0, touching = 0;
+	for (int i = 0; i < 8; i += 2) {
+		neighbours += open[i];
+		touching += open[i] && open[i + 1] && open[(i + 2) % 8];
+	}
+	if (neighbours - touching <= 1) return;
+	bool first = true;
+	for (int i = 0; i < 8; i += 2) {
+		if (!open[i]) continue;
+		if (!first && labelAt(x + ringX[i], y + ringY[i]) == old) {
+			sizes.push_back(0);
+			relabel(x + ringX[i], y + ringY[i], (int)sizes.size() - 1);
+		}
+		first = false;
+	}
+}
+
+// Whether a walk from tile (x0, y0) can reach tile (x1, y1), as the tiles are now.
+bool tilesConnected(const Map& map, int x0, int y0, int x1, int y1) {
+	const RegionMap& regions = map.regions;
+	if (x0 < 0 || y0 < 0 || x0 >= regions.sizeX || y0 >= regions.sizeY) return false;
+	if (x1 < 0 || y1 < 0 || x1 >= regions.sizeX || y1 >= regions.sizeY) return false;
+	int component = getLabel(regions.component, x0, y0);
+	return component != noRegion && component == getLabel(regions.component, x1, y1);
+}
+
+// ----------[ LIGHTING ]--------------
+
+const unsigned char ambientLight = 24;
+
+unsigned char lightFalloff(const Light& light, int x, int y) {
+	int dx = x - light.x, dy = y - light.y;
+	if (dx * dx + dy * dy > light.radius * light.radius) return 0;
+	float d = sqrt((float)(dx * dx + dy * dy));
+	return (unsigned char)(light.intensity * (1 - d / (light.radius + 1)));
+}
+
+unsigned char lightAt(const LightMap& lights, int x, int y) {
+	if (x < 0 || y < 0 || x >= lights.sizeX || y >= lights.sizeY) return 0;
+	return lights.level[(size_t)y * lights.sizeX + x];
+}
+
+// One torch in the middle of every room, lighting the room up to and including its walls.
+void bakeLights(LightMap& lights, const Map& map) {
+	lights.sizeX = map.sizeX;
+	lights.sizeY = map.sizeY;
+	lights.baked.assign((size_t)map.sizeX * map.sizeY, ambientLight);
+	for (const Room& room : allRooms(map)) {
+		int left = room.left, top = room.top;
+		Light torch;
+		torch.x = left + room.sizeX / 2;
+		torch.y = top + room.sizeY / 2;
+		torch.radius = max(room.sizeX, room.sizeY);
+		torch.intensity = 220;
+		for (int y = top; y < top + room.sizeY; y++)
+			for (int x = left; x < left + room.sizeX; x++) {
+				unsigned char& baked = lights.baked[(size_t)y * map.sizeX + x];
+				baked = max(baked, lightFalloff(torch, x, y));
+			}
+	}
+	lights.level = lights.baked;
+}
+
+// Recomputes level inside the box [x0, x1] x [y0, y1] from the baked map and the dynamic lights reaching into it.
+void relightRegion(LightMap& lights, int x0, int y0, int x1, int y1) {
+	x0 = max(x0, 0); y0 = max(y0, 0);
+	x1 = min(x1, lights.sizeX - 1); y1 = min(y1, lights.sizeY - 1);
+	for (int y = y0; y <= y1; y++)
+		memcpy(&lights.level[(size_t)y * lights.sizeX + x0], &lights.baked[(size_t)y * lights.sizeX + x0], x1 - x0 + 1);
+
+	for (const Light& light : lights.dynamicLights) {
+		if (!light.on) continue;
+		int lx0 = max(x0, light.x - light.radius), lx1 = min(x1, light.x + light.radius);
+		int ly0 = max(y0, light.y - light.radius), ly1 = min(y1, light.y + light.radius);
+		for (int y = ly0; y <= ly1; y++)
+			for (int x = lx0; x <= lx1; x++) {
+				unsigned char& level = lights.level[(size_t)y * lights.sizeX + x];
+				level = max(level, lightFalloff(light, x, y));
+			}
+	}
+}
+
+void relightAround(LightMap& lights, const Light& light) {
+	relightRegion(lights, light.x - light.radius, light.y - light.radius, light.x + light.radius, light.y + light.radius);
+}
+
+int addLight(LightMap& lights, Light light) {
+	light.on = true;
+	size_t slot = 0;
+	while (slot < lights.dynamicLights.size() && lights.dynamicLights[slot].on) slot++;
+	if (slot == lights.dynamicLights.size()) lights.dynamicLights.push_back(light);
+	else lights.dynamicLights[slot] = light;
+	relightAround(lights, light);
+	return (int)slot;
+}
+
+void removeLight(LightMap& lights, int index) {
+	Light& light = lights.dynamicLights[index];
+	light.on = false;
+	relightAround(lights, light);
+}
+
+void moveLight(LightMap& lights, int index, int x, int y) {
+	Light& light = lights.dynamicLights[index];
+	if (light.x == x && light.y == y) return;
+	Light old = light;
+	light.x = x;
+	light.y = y;
+	relightAround(lights, old);
+	relightAround(lights, light);
+}
+
+// ----------[ VIEW ]--------------
+
+struct VisibleSprite {
+	float depth{};
+	int column{};
+	int index{}; // into Map::sprites
+};
+
+struct view {
+	int sizeX{}, sizeY{};
+	bool map = false;
+	vector<vector<char>> viewArray;
+
+	vector<vector<char>> minimap;
+	int minimapTileX = -1, minimapTileY = -1;
+	int minimapZoom = 0, minimapZoomShown = -1; // 0 is 1:1, n uses overview level n - 1
+	size_t minimapEdits = 0; // Map::edits already drawn into the minimap
+
+	int rayStep = 1; // cast every rayStep-th column, see updateRayStep
+	float frameBudgetMs = 8;
+
+	vector<float> floorDirX, floorDirY; // per column ray direction scaled to unit perpendicular distance
+	vector<int> floorTileX, floorTileY; // row scratch, see castFloors
+
+	vector<float> depth; // per column perpendicular wall distance from castRays, FLT_MAX where no wall was hit
+	vector<VisibleSprite> visibleSprites; // drawSprites scratch
+};
+
+view createView(int sizeX, int sizeY) {
+	view v;
+	v.sizeX = sizeX;
+	v.sizeY = sizeY;
+	for (int y = 0; y < v.sizeY; y++) {
+		vector<char> temp;
+		for (int x = 0; x < v.sizeX; x++)
+			temp.push_back(' ');
+		v.viewArray.push_back(temp);
+	}
+	return v;
+}
+
+view createView() {
+	int sizeX{}, sizeY{};
+	getTerminalSize(sizeX, sizeY);
+	return createView(sizeX, sizeY);
+}
+
+void clearView(view& v) {
+	for (int y = 0; y < v.sizeY; y++)
+		for (int x = 0; x < v.sizeX; x++)
+			v.viewArray[y][x] = ' ';
+}
+
+// Two columns per cell like cout.width(2), written to the terminal in one go.
+void writeFrame(const vector<vector<char>>& rows) {
+	TraceSpan span("writeFrame");
+	string out;
+	for (const vector<char>& row : rows) {
+		for (char c : row) {
+			out += ' ';
+			out += c;
+		}
+		out += '\n';
+	}
+	cls();
+	cout.write(out.data(), out.size());
+	cout.flush();
+}
+
+void renderView(const view& v) {
+	writeFrame(v.viewArray);
+}
+
+void placeWall(view& v, int x, int y, int height, char c) {
+	if (x < 0 || y < 0 || x >= v.sizeX || y >= v.sizeY) return;
+	for (int h = 0; h < height; h++)
+		if (y + h < v.sizeY)
+			v.viewArray[y + h][x] = c;
+}
+
+// Wall columns are centred on the horizon, the floor and ceiling fill the rest.
+void placeColumn(view& v, int x, int height, char c) {
+	placeWall(v, x, (v.sizeY - height) / 2, height, c);
+}
+
+char stateToChar(Tile s)
+{
+	switch (s)
+	{
+	case WALL:
+	case CORRIDOR_WALL:
+		return '#';
+	case UNDESTRUCT_WALL:
+		return 'W';
+	case AIR:
+	default:
+		return ' ';
+	}
+}
+
+const unsigned char litFloor = 96;
+
+// The 2D map as a picture-in-picture in the top right corner of the 3D view.
+// Only rebuilt when the player steps onto another tile, blitted into viewArray every frame.
+// One overview cell per minimap cell, so the cost depends on the minimap size only.
+void drawOverview(view& v, const OverviewLevel& level, int playerX, int playerY, int innerX, int innerY) {
+	static const char shades[] = { ' ', '.', ':', '+', '#' };
+	int view0X = clamp(playerX - innerX / 2, 0, max(level.sizeX - innerX, 0));
+	int view0Y = clamp(playerY - innerY / 2, 0, max(level.sizeY - innerY, 0));
+	for (int y = 0; y < innerY; y++) {
+		vector<char>& row = v.minimap[y];
+		row[0] = '|';
+		if (view0Y + y >= level.sizeY) continue;
+		const unsigned char* walls = &level.walls[(size_t)(view0Y + y) * level.sizeX];
+		for (int x = 0; x < innerX && view0X + x < level.sizeX; x++)
+			row[1 + x] = shades[(walls[view0X + x] + 63) / 64];
+		if (view0Y + y == playerY) row[1 + playerX - view0X] = 'P';
+	}
+	fill(v.minimap[innerY].begin(), v.minimap[innerY].end(), '-');
+	v.minimap[innerY][0] = '+';
+}
+
+void updateMinimap(view& v, const Map& map, const Player& player)
+{
+	int mapPlayerX = (int)(player.x / tileSize);
+	int mapPlayerY = (int)(player.y / tileSize);
+	int zoom = min(v.minimapZoom, (int)map.overview.levels.size());
+	if (!v.minimap.empty() && mapPlayerX == v.minimapTileX && mapPlayerY == v.minimapTileY && zoom == v.minimapZoomShown &&
+		v.minimapEdits == map.edits.size()) return;
+	v.minimapTileX = mapPlayerX;
+	v.minimapTileY = mapPlayerY;
+	v.minimapZoomShown = zoom;
+	v.minimapEdits = map.edits.size();
+
+	// one column of left border and one row of bottom border around the map window
+	int sizeX = v.sizeX / 3, sizeY = v.sizeY / 3;
+	int innerX = sizeX - 1, innerY = sizeY - 1;
+	v.minimap.assign(max(sizeY, 0), vector<char>(max(sizeX, 0), ' '));
+	if (innerX <= 0 || innerY <= 0) return;
+
+	if (zoom > 0) {
+		drawOverview(v, map.overview.levels[zoom - 1], mapPlayerX >> zoom, mapPlayerY >> zoom, innerX, innerY);
+		return;
+	}
+
+	int view0X = clamp(mapPlayerX - innerX / 2, 0, max(map.sizeX - innerX, 0));
+	int view0Y = clamp(mapPlayerY - innerY / 2, 0, max(map.sizeY - innerY, 0));
+
+	for (int y = 0; y < innerY; y++)
+	{
+		vector<char>& row = v.minimap[y];
+		row[0] = '|';
+		if (view0Y + y >= map.sizeY) continue;
+		forEachSpan(map.tiles, view0Y + y, view0X, min(view0X + innerX, map.sizeX), [&](int fromX, int toX, Tile tile) {
+			if (tile == WALL) {
+				memset(&row[1 + fromX - view0X], stateToChar(tile), toX - fromX);
+				return;
+			}
+			for (int x = fromX; x < toX; x++)
+				row[1 + x - view0X] = lightAt(map.lights, x, view0Y + y) >= litFloor ? '.' : ' ';
+		});
+		if (view0Y + y == mapPlayerY) row[1 + mapPlayerX - view0X] = 'P';
+	}
+	fill(v.minimap[innerY].begin(), v.minimap[innerY].end(), '-');
+	v.minimap[innerY][0] = '+';
+}
+
+void blitMinimap(view& v) {
+	if (v.minimap.empty() || v.minimap[0].empty()) return;
+	int left = v.sizeX - (int)v.minimap[0].size();
+	for (size_t y = 0; y < v.minimap.size(); y++)
+		memcpy(&v.viewArray[y][left], v.minimap[y].data(), v.minimap[y].size());
+}
+
+// ----------[ CAVES ]--------------
+// Cellular automaton caves. Cells are bits, 64 to a word, and a smoothing step works on whole
+// words: the 3 x 3 neighbourhoods of 64 cells are summed in bit slices by a carry-save adder tree,
+// a dozen or so word operations for all 64. Rows only read the previous step, so large caves are
+// smoothed in bands of rows on several threads. Afterwards every floor region but the largest is
+// filled in, found by union-find over the runs of floor in each row.
+
+const int caveWallPercent = 45;
+const int caveSmoothingSteps = 5;
+const int caveBandRows = 256; // fewer rows than this aren't worth a thread of their own
+
+// A set bit is a wall. Bits past sizeX in a row's last word stay set.
+struct CaveBits {
+	int sizeX{}, sizeY{};
+	int words{}; // per row
+	uint64_t* cells = nullptr;
+	uint64_t* operator[](int y) const { return cells + (size_t)y * words; }
+};
+
+// A run of floor in one row, [start, end), and its union-find parent.
+struct CaveRun {
+	int start{}, end{};
+	int parent{};
+	int size{}; // floor cells in the region, kept on its root
+};
+
+// nullptr cells once the caller's memory is used up.
+CaveBits makeCaveBits(Arena& arena, int sizeX, int sizeY) {
+	CaveBits bits;
+	bits.sizeX = sizeX;
+	bits.sizeY = sizeY;
+	bits.words = (sizeX + 63) / 64;
+	bits.cells = arenaArray<uint64_t>(arena, (size_t)bits.words * sizeY);
+	return bits;
+}
+
+// Both bit grids and the most floor runs there can be (every other cell), plus alignment.
+constexpr size_t caveScratchBytes(int sizeX, int sizeY) {
+	size_t words = (size_t)(sizeX + 63) / 64 * sizeY;
+	return 2 * words * sizeof(uint64_t) + ((size_t)sizeY + 1) * sizeof(int) +
+		((size_t)(sizeX + 1) / 2 * sizeY) * sizeof(CaveRun) + 4 * alignof(max_align_t);
+}
+
+// The bits of a row's last word past sizeX.
+uint64_t caveTail(const CaveBits& bits) {
+	return bits.sizeX % 64 ? ~0ull << (bits.sizeX % 64) : 0;
+}
+
+// Roughly caveWallPercent walls. Every cell is its row stream's draw at x, so any cell can be
+// worked out on its own.
+void seedCave(CaveBits& bits, unsigned int seed) {
+	const uint64_t threshold = (uint64_t)caveWallPercent * 0x100000000ull / 100;
+	for (int y = 0; y < bits.sizeY; y++) {
+		Random row = randomStream(seed, 0, y, CAVE_STREAM);
+		uint64_t* words = bits[y];
+		for (int w = 0; w < bits.words; w++) {
+			uint64_t word = 0;
+			for (int i = 0; i < 64 && w * 64 + i < bits.sizeX; i++)
+				word |= (uint64_t)(randomAt(row, (uint64_t)w * 64 + i) < threshold) << i;
+			words[w] = word;
+		}
+		words[bits.words - 1] |= caveTail(bits);
+	}
+}
+
+// One step for rows [first, last): a cell becomes a wall if at least 5 of the 9 cells around and
+// including it are walls. Cells off the map count as walls.
+void smoothCaveRows(const CaveBits& from, const CaveBits& to, int first, int last) {
+	const uint64_t walls = ~0ull;
+	for (int y = first; y < last; y++) {
+		for (int w = 0; w < from.words; w++) {
+			// each row's west, centre and east bits through a full adder: ones and twos
+			uint64_t ones[3], twos[3];
+			for (int r = 0; r < 3; r++) {
+				int rowY = y + r - 1;
+				const uint64_t* row = rowY >= 0 && rowY < from.sizeY ? from[rowY] : nullptr;
+				uint64_t centre = row ? row[w] : walls;
+				uint64_t before = row && w > 0 ? row[w - 1] : walls;
+				uint64_t after = row && w + 1 < from.words ? row[w + 1] : walls;
+				uint64_t west = centre << 1 | before >> 63;
+				uint64_t east = centre >> 1 | after << 63;
+				ones[r] = west ^ centre ^ east;
+				twos[r] = (west & centre) | (east & (west ^ centre));
+			}
+			// the rows added up: count = one + 2 * two + 4 * four + 8 * eight
+			uint64_t one = ones[0] ^ ones[1] ^ ones[2];
+			uint64_t carry = (ones[0] & ones[1]) | (ones[2] & (ones[0] ^ ones[1]));
+			uint64_t twoSum = twos[0] ^ twos[1] ^ twos[2];
+			uint64_t fourSum = (twos[0] & twos[1]) | (twos[2] & (twos[0] ^ twos[1]));
+			uint64_t two = twoSum ^ carry;
+			uint64_t fourCarry = twoSum & carry;
+			uint64_t four = fourSum ^ fourCarry;
+			uint64_t eight = fourSum & fourCarry;
+			to[y][w] = eight | (four & (two | one));
+		}
+		to[y][to.words - 1] |= caveTail(to);
+	}
+}
+
+// Returns whichever of the two buffers holds the result.
+CaveBits smoothCave(CaveBits bits, CaveBits spare, int requestedThreads) {
+	int threads = threadCount(requestedThreads, (size_t)bits.sizeY / caveBandRows);
+	for (int step = 0; step < caveSmoothingSteps; step++) {
+		vector<thread> bands;
+		for (int t = 1; t < threads; t++)
+			bands.emplace_back(smoothCaveRows, cref(bits), cref(spare), bits.sizeY * t / threads, bits.sizeY * (t + 1) / threads);
+		smoothCaveRows(bits, spare, 0, bits.sizeY / threads);
+		for (thread& band : bands) band.join();
+		swap(bits, spare);
+	}
+	return bits;
+}
+
+// Calls f(start, end) for every run of floor in row y, left to right.
+template <typename F>
+void forEachFloorRun(const CaveBits& bits, int y, F f) {
+	const uint64_t* row = bits[y];
+	int x = 0;
+	while (x < bits.sizeX) {
+		// the next floor cell, whole words of wall at a time
+		int w = x / 64;
+		uint64_t floor = ~row[w] & (~0ull << (x % 64));
+		while (!floor && ++w < bits.words) floor = ~row[w];
+		if (!floor) return;
+		int start = w * 64 + lowestBit(floor);
+		// and the next wall after it; the tail bits end the last run
+		uint64_t wall = row[w] & (~0ull << (start % 64));
+		while (!wall && ++w < bits.words) wall = row[w];
+		int end = wall ? w * 64 + lowestBit(wall) : bits.sizeX;
+		f(start, end);
+		x = end;
+	}
+}
+
+int findRun(CaveRun* runs, int run) {
+	while (runs[run].parent != run) {
+		runs[run].parent = runs[runs[run].parent].parent;
+		run = runs[run].parent;
+	}
+	return run;
+}
+
+void fillCaveRun(const CaveBits& bits, int y, int start, int end) {
+	uint64_t* row = bits[y];
+	for (int x = start; x < end;) {
+		int w = x / 64, first = x % 64;
+		int count = min(end - x, 64 - first);
+		row[w] |= (count == 64 ? ~0ull : ((1ull << count) - 1)) << first;
+		x += count;
+	}
+}
+
+// Fills in every floor region but the largest; regions connect through edges, not corners.
+// False if the runs don't fit the caller's memory.
+bool keepLargestCave(const CaveBits& bits, Arena& arena) {
+	int* rowFirst = arenaArray<int>(arena, (size_t)bits.sizeY + 1);
+	if (!rowFirst) return false;
+	int runCount = 0;
+	for (int y = 0; y < bits.sizeY; y++) {
+		rowFirst[y] = runCount;
+		forEachFloorRun(bits, y, [&](int, int) { runCount++; });
+	}
+	rowFirst[bits.sizeY] = runCount;
+	CaveRun* runs = arenaArray<CaveRun>(arena, runCount);
+	if (!runs) return false;
+	for (int y = 0, run = 0; y < bits.sizeY; y++)
+		forEachFloorRun(bits, y, [&](int start, int end) {
+			runs[run].start = start;
+			runs[run].end = end;
+			runs[run].parent = run;
+			run++;
+		});
+
+	// join every run with the overlapping runs of the row above, both rows sorted by x
+	for (int y = 1; y < bits.sizeY; y++) {
+		int above = rowFirst[y - 1], run = rowFirst[y];
+		while (above < rowFirst[y] && run < rowFirst[y + 1]) {
+			if (runs[above].start < runs[run].end && runs[run].start < runs[above].end) {
+				int a = findRun(runs, above), b = findRun(runs, run);
+				if (a != b) runs[max(a, b)].parent = min(a, b);
+			}
+			if (runs[above].end < runs[run].end) above++;
+			else run++;
+		}
+	}
+
+	int largest = -1;
+	for (int run = 0; run < runCount; run++) {
+		int root = findRun(runs, run);
+		runs[root].size += runs[run].end - runs[run].start;
+		if (largest < 0 || runs[root].size > runs[largest].size) largest = root;
+	}
+	for (int y = 0; y < bits.sizeY; y++)
+		for (int run = rowFirst[y]; run < rowFirst[y + 1]; run++)
+			if (findRun(runs, run) != largest) fillCaveRun(bits, y, runs[run].start, runs[run].end);
+	return true;
+}
+
+// Carves a cave into map.tileArray and puts the player on the floor closest to the middle.
+// The bit grids and runs come from the generation arena; false if they don't fit the caller's memory.
+bool carveCave(Map& map) {
+	CaveBits bits = makeCaveBits(map.arena, map.sizeX, map.sizeY);
+	CaveBits spare = makeCaveBits(map.arena, map.sizeX, map.sizeY);
+	if (!bits.cells || !spare.cells) return false;
+	seedCave(bits, map.seed);
+	bits = smoothCave(bits, spare, map.caveThreads);
+	// the border is sealed afterwards, so no region may rely on it
+	fillCaveRun(bits, 0, 0, map.sizeX);
+	fillCaveRun(bits, map.sizeY - 1, 0, map.sizeX);
+	for (int y = 0; y < map.sizeY; y++) {
+		fillCaveRun(bits, y, 0, 1);
+		fillCaveRun(bits, y, map.sizeX - 1, map.sizeX);
+	}
+	if (!keepLargestCave(bits, map.arena)) return false;
+
+	long long closest = LLONG_MAX;
+	for (int y = 0; y < map.sizeY; y++) {
+		const uint64_t* row = bits[y];
+		for (int x = 0; x < map.sizeX; x++) {
+			bool wall = row[x / 64] >> (x % 64) & 1;
+			map.tileArray[y][x] = wall ? WALL : AIR;
+			long long dX = x - map.sizeX / 2, dY = y - map.sizeY / 2;
+			if (!wall && dX * dX + dY * dY < closest) {
+				closest = dX * dX + dY * dY;
+				map.player.x = (x + 0.5f) * tileSize;
+				map.player.y = (y + 0.5f) * tileSize;
+			}
+		}
+	}
+	return true;
+}
+
+// ----------[ MAP ]--------------
+
+// Every room shape generateRandomRoom can roll, baked at compile time.
+// Indexed by [sizeX - minSize][sizeY - minSize][offsetX][offsetY], one full room cell each.
+struct RoomPrefab {
+	Tile tiles[Room::maxSizeY][Room::maxSizeX]{};
+};
+
+constexpr int prefabsX = Room::maxSizeX - Room::minSize;
+constexpr int prefabsY = Room::maxSizeY - Room::minSize;
+
+struct PrefabTable {
+	RoomPrefab prefabs[prefabsX][prefabsY][prefabsX][prefabsY]{};
+};
+
+constexpr RoomPrefab makePrefab(int sizeX, int sizeY, int offsetX, int offsetY) {
+	RoomPrefab prefab{};
+	for (int y = offsetY; y < offsetY + sizeY; y++)
+		for (int x = offsetX; x < offsetX + sizeX; x++)
+		{
+			if (x == offsetX || x == offsetX + sizeX - 1 || y == offsetY || y == offsetY + sizeY - 1)
+				prefab.tiles[y][x] = WALL;
+			else
+				prefab.tiles[y][x] = ROOM_AIR;
+		}
+	return prefab;
+}
+
+constexpr PrefabTable makePrefabTable() {
+	PrefabTable table{};
+	for (int sX = 0; sX < prefabsX; sX++)
+		for (int sY = 0; sY < prefabsY; sY++)
+			for (int oX = 0; oX < Room::maxSizeX - (sX + Room::minSize); oX++)
+				for (int oY = 0; oY < Room::maxSizeY - (sY + Room::minSize); oY++)
+					table.prefabs[sX][sY][oX][oY] = makePrefab(sX + Room::minSize, sY + Room::minSize, oX, oY);
+	return table;
+}
+
+constexpr PrefabTable prefabTable = makePrefabTable();
+
+const RoomPrefab& selectPrefab(const Room& room) {
+	return prefabTable.prefabs[room.sizeX - Room::minSize][room.sizeY - Room::minSize][room.offsetX][room.offsetY];
+}
+
+void blitPrefab(Map& map, const Room& room, const RoomPrefab& prefab) {
+	int mapX = room.mapX * Room::maxSizeX;
+	int mapY = room.mapY * Room::maxSizeY;
+	for (int rY = 0; rY < Room::maxSizeY; rY++)
+		memcpy(&map.tileArray[mapY + rY][mapX], prefab.tiles[rY], sizeof(prefab.tiles[rY]));
+}
+
+// 2 to 4 doors on random walls, recorded in the room.
+void punchDoors(Map& map, Room& room, Random random) {
+	int doorCount = randInt(random, 2, 5);
+	for (int i = 0; i < doorCount; i++)
+	{
+		Direction randDir = randDirection(random);
+		int x = room.left, y = room.top;
+		if (randDir == NORTH)
+			x += randInt(random, 1, room.sizeX - 2);
+		if (randDir == SOUTH) {
+			x += randInt(random, 1, room.sizeX - 2);
+			y += room.sizeY - 1;
+		}
+		if (randDir == WEST)
+			y += randInt(random, 1, room.sizeY - 2);
+		if (randDir == EAST) {
+			y += randInt(random, 1, room.sizeY - 2);
+			x += room.sizeX - 1;
+		}
+		map.tileArray[y][x] = DOOR;
+		room.doors[room.doorCount] = randDir;
+		room.doorX[room.doorCount] = x;
+		room.doorY[room.doorCount] = y;
+		room.doorCount++;
+	}
+}
+
+Room generateRandomRoom(Map& map, int x, int y)
+{
+	TraceSpan span("generateRandomRoom", x, y);
+	Room randRoom;
+	Random random = randomStream(map.seed, x, y, ROOM_STREAM);
+
+	randRoom.mapX = x;
+	randRoom.mapY = y;
+
+	randRoom.sizeX = randInt(random, Room::minSize, randRoom.maxSizeX);
+	randRoom.sizeY = randInt(random, Room::minSize, randRoom.maxSizeY);
+
+	randRoom.offsetX = randInt(random, 0, randRoom.maxSizeX - randRoom.sizeX);
+	randRoom.offsetY = randInt(random, 0, randRoom.maxSizeY - randRoom.sizeY);
+	randRoom.left = x * randRoom.maxSizeX + randRoom.offsetX;
+	randRoom.top = y * randRoom.maxSizeY + randRoom.offsetY;
+
+	blitPrefab(map, randRoom, selectPrefab(randRoom));
+	punchDoors(map, randRoom, randomStream(map.seed, x, y, DOOR_STREAM));
+
+	return randRoom;
+}
+
+// Scattered placement: Poisson-disk sampling (Bridson) with variable room sizes: new rooms are tried in a ring around
+// a random active room and accepted if they keep scatterGap tiles away from every other room, which
+// the room hash answers by looking at no more than four buckets. Every accepted room is tried
+// around at most scatterTries times, so placement is linear in the number of rooms.
+
+const int scatterGap = 3; // room wall to room wall, enough for a corridor with its walls
+const int scatterTries = 30;
+
+// The most rooms a floor can hold. Scattered rooms stay scatterGap apart, so every room together
+// with a gap's width to its right and below covers at least (minSize + scatterGap)^2 tiles of its own.
+constexpr int maxRoomCount(const MapParams& params) {
+	if (params.placement == LATTICE_PLACEMENT) return params.roomsX * params.roomsY;
+	if (params.placement == CAVE_PLACEMENT) return 0;
+	int sizeX = params.roomsX * Room::maxSizeX, sizeY = params.roomsY * Room::maxSizeY;
+	return (sizeX + scatterGap) * (sizeY + scatterGap) / ((Room::minSize + scatterGap) * (Room::minSize + scatterGap));
+}
+
+constexpr size_t roomHashBytes(const MapParams& params) {
+	if (params.placement != POISSON_PLACEMENT) return 0;
+	size_t buckets = (size_t)((params.roomsX * Room::maxSizeX + RoomHash::bucketSize - 1) / RoomHash::bucketSize) *
+		((params.roomsY * Room::maxSizeY + RoomHash::bucketSize - 1) / RoomHash::bucketSize);
+	return (2 * buckets + 2 * 4 * (size_t)maxRoomCount(params)) * sizeof(int) + 4 * alignof(int);
+}
+
+// Rooms and room hash, with room for the arena to align them.
+constexpr size_t roomStorageBytes(const MapParams& params) {
+	return maxRoomCount(params) * sizeof(Room) + alignof(Room) + roomHashBytes(params);
+}
+
+void hashRoom(RoomHash& hash, const Room& room, int index) {
+	for (int by = room.top / RoomHash::bucketSize; by <= (room.top + room.sizeY - 1) / RoomHash::bucketSize; by++)
+		for (int bx = room.left / RoomHash::bucketSize; bx <= (room.left + room.sizeX - 1) / RoomHash::bucketSize; bx++) {
+			int bucket = by * hash.bucketsX + bx;
+			int entry = hash.entries++;
+			hash.room[entry] = index;
+			hash.next[entry] = -1;
+			if (hash.last[bucket] < 0) hash.first[bucket] = entry;
+			else hash.next[hash.last[bucket]] = entry;
+			hash.last[bucket] = entry;
+		}
+}
+
+// Calls f(index) for every room in the bucket, in the order they were hashed.
+template <typename F>
+void forEachInBucket(const RoomHash& hash, int bx, int by, F f) {
+	for (int entry = hash.first[by * hash.bucketsX + bx]; entry >= 0; entry = hash.next[entry])
+		f(hash.room[entry]);
+}
+
+// Calls f(index) for every room listed in a bucket overlapping [x0, x1] x [y0, y1]. A room spanning
+// several of those buckets is reported once per bucket.
+template <typename F>
+void forEachHashedRoom(const RoomHash& hash, int x0, int y0, int x1, int y1, F f) {
+	int bx0 = max(x0 / RoomHash::bucketSize, 0), bx1 = min(x1 / RoomHash::bucketSize, hash.bucketsX - 1);
+	int by0 = max(y0 / RoomHash::bucketSize, 0), by1 = min(y1 / RoomHash::bucketSize, hash.bucketsY - 1);
+	for (int by = by0; by <= by1; by++)
+		for (int bx = bx0; bx <= bx1; bx++)
+			forEachInBucket(hash, bx, by, f);
+}
+
+bool roomFits(const Map& map, const Room& room) {
+	if (room.left < 2 || room.top < 2 || room.left + room.sizeX > map.sizeX - 2 || room.top + room.sizeY > map.sizeY - 2)
+		return false;
+	const Room* rooms = map.rooms;
+	bool fits = true;
+	forEachHashedRoom(map.roomHash, room.left - scatterGap, room.top - scatterGap,
+		room.left + room.sizeX - 1 + scatterGap, room.top + room.sizeY - 1 + scatterGap, [&](int index) {
+			const Room& other = rooms[index];
+			if (room.left - scatterGap < other.left + other.sizeX && other.left < room.left + room.sizeX + scatterGap &&
+				room.top - scatterGap < other.top + other.sizeY && other.top < room.top + room.sizeY + scatterGap)
+				fits = false;
+		});
+	return fits;
+}
+
+void stampRoom(Map& map, const Room& room) {
+	for (int y = room.top; y < room.top + room.sizeY; y++)
+		for (int x = room.left; x < room.left + room.sizeX; x++)
+			if (x == room.left || x == room.left + room.sizeX - 1 || y == room.top || y == room.top + room.sizeY - 1)
+				map.tileArray[y][x] = WALL;
+			else
+				map.tileArray[y][x] = ROOM_AIR;
+}
+
+// Rooms go to map.rooms, which holds maxRoomCount of them. The hash comes from map.roomArena, the
+// active list from the generation arena.
+void scatterRooms(Map& map) {
+	RoomHash& hash = map.roomHash;
+	hash.bucketsX = (map.sizeX + RoomHash::bucketSize - 1) / RoomHash::bucketSize;
+	hash.bucketsY = (map.sizeY + RoomHash::bucketSize - 1) / RoomHash::bucketSize;
+	int buckets = hash.bucketsX * hash.bucketsY;
+	hash.first = arenaArray<int>(map.roomArena, buckets);
+	hash.last = arenaArray<int>(map.roomArena, buckets);
+	hash.next = arenaArray<int>(map.roomArena, 4 * (size_t)map.roomCapacity);
+	hash.room = arenaArray<int>(map.roomArena, 4 * (size_t)map.roomCapacity);
+	fill_n(hash.first, buckets, -1);
+	fill_n(hash.last, buckets, -1);
+	hash.entries = 0;
+	Room* rooms = map.rooms;
+	map.roomCount = 0;
+
+	Random random = randomStream(map.seed, 0, 0, SCATTER_STREAM);
+	// clamped so that it fits a map of a single lattice cell, which the player has to start in
+	Room first;
+	first.sizeX = min(randInt(random, Room::minSize, Room::maxScatteredSize), map.sizeX - 4);
+	first.sizeY = min(randInt(random, Room::minSize, Room::maxScatteredSize), map.sizeY - 4);
+	first.left = randInt(random, 2, max(3, map.sizeX - first.sizeX - 2));
+	first.top = randInt(random, 2, max(3, map.sizeY - first.sizeY - 2));
+	if (!roomFits(map, first)) return;
+	rooms[map.roomCount++] = first;
+	hashRoom(hash, first, 0);
+
+	int* active = arenaArray<int>(map.arena, map.roomCapacity);
+	int activeCount = 0;
+	active[activeCount++] = 0;
+	while (activeCount > 0) {
+		int slot = randInt(random, 0, activeCount);
+		Room around = rooms[active[slot]];
+		int centerX = around.left + around.sizeX / 2, centerY = around.top + around.sizeY / 2;
+
+		bool placed = false;
+		for (int i = 0; i < scatterTries && !placed; i++) {
+			Room room;
+			room.sizeX = randInt(random, Room::minSize, Room::maxScatteredSize);
+			room.sizeY = randInt(random, Room::minSize, Room::maxScatteredSize);
+			// between one and two spacings from the active room's centre
+			float spacing = (max(around.sizeX, around.sizeY) + max(room.sizeX, room.sizeY)) / 2.0f + scatterGap;
+			float angle = randInt(random, 0, 3600) * (float)PI / 1800;
+			float distance = spacing * (1 + randInt(random, 0, 1000) / 1000.0f);
+			room.left = centerX + (int)(cos(angle) * distance) - room.sizeX / 2;
+			room.top = centerY + (int)(sin(angle) * distance) - room.sizeY / 2;
+			if (!roomFits(map, room)) continue;
+
+			rooms[map.roomCount] = room;
+			hashRoom(hash, room, map.roomCount);
+			active[activeCount++] = map.roomCount++;
+			placed = true;
+		}
+		if (!placed)
+			active[slot] = active[--activeCount];
+	}
+
+	for (int i = 0; i < map.roomCount; i++) {
+		stampRoom(map, rooms[i]);
+		punchDoors(map, rooms[i], randomStream(map.seed, i, 0, DOOR_STREAM));
+	}
+}
+
+void sealBorder(Map& map) {
+	for (int x = 0; x < map.sizeX; x++) {
+		map.tileArray[0][x] = UNDESTRUCT_WALL;
+		map.tileArray[map.sizeY - 1][x] = UNDESTRUCT_WALL;
+	}
+	for (int y = 0; y < map.sizeY; y++) {
+		map.tileArray[y][0] = UNDESTRUCT_WALL;
+		map.tileArray[y][map.sizeX - 1] = UNDESTRUCT_WALL;
+	}
+}
+
+// Copies what the params decide into the map and sizes it.
+void setupMap(Map& map, const MapParams& params) {
+	map.roomsX = params.roomsX;
+	map.roomsY = params.roomsY;
+	map.seed = params.seed;
+	map.placement = params.placement;
+	map.verbose = params.verbose;
+	map.memory = params.memory;
+	map.routingThreads = params.routingThreads;
+	map.caveThreads = params.caveThreads;
+	map.sizeX = map.roomsX * Room::maxSizeX;
+	map.sizeY = map.roomsY * Room::maxSizeY;
+	map.roomCapacity = maxRoomCount(params);
+}
+
+// Lays the rooms out in map.tileArray and map.rooms, which the caller has set up (see generateMap),
+// and puts the player in the middle room. False if a cave doesn't fit the caller's memory.
+bool layoutRooms(Map& map) {
+	if (map.placement == CAVE_PLACEMENT) {
+		if (map.verbose) cout << "Carving caves..." << endl;
+		bool carved = carveCave(map);
+		sealBorder(map);
+		return carved;
+	}
+	if (map.verbose) cout << "Creating rooms..." << endl;
+	if (map.placement == POISSON_PLACEMENT) {
+		scatterRooms(map);
+		sealBorder(map);
+
+		// start in the room closest to the middle of the map
+		const Room* centerRoom = nullptr;
+		long long closest = LLONG_MAX;
+		for (const Room& room : allRooms(map)) {
+			long long dX = room.left + room.sizeX / 2 - map.sizeX / 2, dY = room.top + room.sizeY / 2 - map.sizeY / 2;
+			if (dX * dX + dY * dY < closest) {
+				closest = dX * dX + dY * dY;
+				centerRoom = &room;
+			}
+		}
+		if (centerRoom) {
+			map.player.x = (centerRoom->left + centerRoom->sizeX / 2) * tileSize;
+			map.player.y = (centerRoom->top + centerRoom->sizeY / 2) * tileSize;
+		}
+		return true;
+	}
+
+	for (int y = 0; y < map.roomsY; y++)
+		for (int x = 0; x < map.roomsX; x++)
+			map.rooms[y * map.roomsX + x] = generateRandomRoom(map, x, y);
+	map.roomCount = map.roomsX * map.roomsY;
+	sealBorder(map);
+
+
+	const Room& centerRoom = map.rooms[map.roomsY / 2 * map.roomsX + map.roomsX / 2];
+	map.player.x = (centerRoom.mapX * Room::maxSizeX + centerRoom.sizeX / 2) * tileSize;
+	map.player.y = (centerRoom.mapY * Room::maxSizeY + centerRoom.sizeY / 2) * tileSize;
+	return true;
+}
+
+Map generateMap(const MapParams& params = MapParams()) {
+	TraceSpan span("generateMap");
+	Map map;
+	setupMap(map, params);
+	if (map.verbose) cout << "Generating map..." << endl;
+	// one block for the grid, the routing labels and the stack that fills them, with as much as the
+	// grid again left for the doors and corridor bits
+	map.arena.blockSize = (2 * sizeof(Tile) + 2 * sizeof(int)) * map.sizeX * map.sizeY;
+	map.arena.account = map.memory;
+	map.tileArray = arenaGrid<Tile>(map.arena, map.sizeX, map.sizeY);
+	map.roomArena.blockSize = roomStorageBytes(params);
+	map.roomArena.account = map.memory;
+	map.roomArena.subsystem = ROOM_MEMORY;
+	map.rooms = arenaArray<Room>(map.roomArena, map.roomCapacity);
+
+	layoutRooms(map);
+	return map;
+}
+
+void normalizeTiles(Map& map) {
+	for (int y = 0; y < map.sizeY; y++)
+		for (int x = 0; x < map.sizeX; x++)
+			map.tileArray[y][x] = isWalkable(map.tileArray[y][x]) ? AIR : WALL;
+}
+
+// The room whose rectangle, walls included, contains the tile, nullptr outside of rooms. A lookup
+// once labelRegions has run.
+const Room* getRoomFromMapCoords(const Map& map, int x, int y) {
+	if (x < 0 || y < 0 || x >= map.sizeX || y >= map.sizeY || map.placement == CAVE_PLACEMENT) return nullptr;
+	if (!map.regions.region.empty()) {
+		int region = getLabel(map.regions.region, x, y);
+		return region != noRegion && region < map.roomCount ? &map.rooms[region] : nullptr;
+	}
+	auto contains = [&](const Room& room) {
+		return x >= room.left && y >= room.top && x < room.left + room.sizeX && y < room.top + room.sizeY;
+	};
+	if (map.placement == LATTICE_PLACEMENT) {
+		const Room& room = map.rooms[y / Room::maxSizeY * map.roomsX + x / Room::maxSizeX];
+		return contains(room) ? &room : nullptr;
+	}
+	const RoomHash& hash = map.roomHash;
+	for (int entry = hash.first[y / RoomHash::bucketSize * hash.bucketsX + x / RoomHash::bucketSize]; entry >= 0; entry = hash.next[entry])
+		if (contains(map.rooms[hash.room[entry]])) return &map.rooms[hash.room[entry]];
+	return nullptr;
+}
+
+Tile getTileFromPlayerCoords(const Map& map, int x, int y) {
+	int mapPlayerX = (int)(x / tileSize);
+	int mapPlayerY = (int)(y / tileSize);
+	return getTile(map.tiles, mapPlayerX, mapPlayerY);
+}
+
+// Gameplay tile changes go through here. Everything derived from the tiles is patched around the
+// changed tile only: the distance field within maxWallDistance, one overview cell per level, the
+// walkable components the tile touches.
+// Map::edits doubles as the change notification, consumers remember how many edits they've seen
+// (saves, the minimap, server sessions).
+void changeTile(Map& map, int x, int y, Tile tile) {
+	if (getTile(map.tiles, x, y) == tile) return;
+	setTile(map.tiles, x, y, tile);
+	map.edits.push_back({ (unsigned short)x, (unsigned short)y, (unsigned char)tile });
+	updateDistanceField(map, x, y);
+	updateOverview(map, x, y);
+	updateRegions(map, x, y);
+}
+
+// The border stays, everything else can be dug out or built up. Tiles are already normalized
+// at runtime, so digging leaves AIR and building leaves WALL.
+bool isDestructible(const Map& map, int x, int y) {
+	return x > 0 && y > 0 && x < map.sizeX - 1 && y < map.sizeY - 1;
+}
+
+bool digTile(Map& map, int x, int y) {
+	if (!isDestructible(map, x, y) || getTile(map.tiles, x, y) != WALL) return false;
+	changeTile(map, x, y, AIR);
+	return true;
+}
+
+bool buildTile(Map& map, int x, int y) {
+	if (!isDestructible(map, x, y) || getTile(map.tiles, x, y) == WALL) return false;
+	changeTile(map, x, y, WALL);
+	return true;
+}
+
+// ----------[ PATHFINDING ]--------------
+
+
+// A*
+// https://dev.to/jansonsa/a-star-a-path-finding-c-4a4h
+
+struct Node {
+	int x, y;
+	int parentX = -1, parentY = -1;
+	float gCost = FLT_MAX, hCost = FLT_MAX, fCost = FLT_MAX;
+};
+
+inline bool operator < (const Node& lhs, const Node& rhs)
+{
+	return lhs.fCost < rhs.fCost;
+}
+
+// Scattered rooms: search the room hash in growing rings of buckets around the door and stop once
+// no unvisited bucket can hold anything closer.
+Node findClosestScatteredDoor(const Map& map, int sX, int sY) {
+	Node closest;
+	closest.x = sX;
+	closest.y = sY;
+	float closestDist = FLT_MAX;
+	const Room* own = getRoomFromMapCoords(map, sX, sY);
+	const RoomHash& hash = map.roomHash;
+	int bX = sX / RoomHash::bucketSize, bY = sY / RoomHash::bucketSize;
+
+	for (int ring = 0; ring <= max(hash.bucketsX, hash.bucketsY); ring++) {
+		for (int by = bY - ring; by <= bY + ring; by++)
+			for (int bx = bX - ring; bx <= bX + ring; bx++) {
+				if (max(abs(bx - bX), abs(by - bY)) != ring) continue;
+				if (bx < 0 || by < 0 || bx >= hash.bucketsX || by >= hash.bucketsY) continue;
+				forEachInBucket(hash, bx, by, [&](int index) {
+					const Room& room = map.rooms[index];
+					if (&room == own) return;
+					for (int d = 0; d < room.doorCount; d++) {
+						float doorDist = dist(sX, sY, room.doorX[d], room.doorY[d]);
+						if (closestDist > doorDist) {
+							closestDist = doorDist;
+							closest.x = room.doorX[d];
+							closest.y = room.doorY[d];
+						}
+					}
+				});
+			}
+		// everything in the next ring is at least ring buckets away
+		if (closestDist <= (float)ring * RoomHash::bucketSize) break;
+	}
+
+	return closest;
+}
+
+Node findClosestDoor(const Map& map, int sX, int sY) {
+	TraceSpan span("findClosestDoor", sX, sY);
+	if (map.placement == POISSON_PLACEMENT) return findClosestScatteredDoor(map, sX, sY);
+	Node closest;
+	closest.x = sX;
+	closest.y = sY;
+	float closestDist = FLT_MAX;
+
+	const Room* own = getRoomFromMapCoords(map, sX, sY);
+	for (int y = 0; y < map.sizeY; y++)
+		for (int x = 0; x < map.sizeX; x++) {
+			if (map.tileArray[y][x] != DOOR || (x == sX && y == sY)) continue;
+			if (getRoomFromMapCoords(map, x, y) == own) continue;
+			if (closestDist > dist(sX, sY, x, y)) {
+				closestDist = dist(sX, sY, x, y);
+				closest.x = x;
+				closest.y = y;
+			}
+		}
+
+	return closest;
+}
+
+bool isValid(int x, int y, const Map& map) {
+	if (x < 0 && y < 0 && x >= map.sizeX && y >= map.sizeY) return false;
+	if (map.tileArray[y][x] == AIR || map.tileArray[y][x] == DOOR) return true;
+	return false;
+}
+
+double calculateH(int x, int y, Node dest) {
+	double H = (sqrt((x - dest.x) * (x - dest.x)
+		+ (y - dest.y) * (y - dest.y)));
+	return H;
+}
+
+bool isDestination(int x, int y, Node tile) {
+	return (tile.x == x && tile.y == y);
+}
+
+// A found corridor: the tile it starts on and a 3-bit direction for every step after that, packed
+// 21 to a word. Lives in the search scratch until it is stamped.
+struct Path {
+	int startX{}, startY{};
+	int length{}; // tiles, the start included; 0 if there is no corridor
+	uint64_t* directions = nullptr;
+};
+
+const int pathStepsPerWord = 21;
+// the eight steps a search can take, by direction code
+const int pathStepX[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+const int pathStepY[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+
+int pathDirection(int dx, int dy) {
+	int code = (dx + 1) * 3 + dy + 1;
+	return code > 4 ? code - 1 : code;
+}
+
+int pathStep(const Path& path, int step) {
+	return (int)(path.directions[step / pathStepsPerWord] >> (step % pathStepsPerWord * 3)) & 7;
+}
+
+// Everything one search allocates from its scratch arena: the two grids, the open list and the
+// directions of the path it finds (at most two steps per tile), plus what aligning them can cost.
+constexpr size_t searchScratchBytes(int sizeX, int sizeY) {
+	size_t area = (size_t)sizeX * sizeY;
+	return sizeof(bool) * area + sizeof(Node) * (area + area + 8) + sizeof(uint64_t) * (2 * area / pathStepsPerWord + 1) +
+		3 * alignof(Node) + alignof(uint64_t);
+}
+
+// Walks the parent links back from the destination twice, once to count the steps and once to
+// pack them, last step first. A diagonal step goes round whichever of its corners is open,
+// horizontal first, so the corridor can be walked tile by tile; it stays diagonal only where both
+// corners are walls.
+void makePath(const Grid<Node>& map, Node destination, const Map& m, Arena& scratch, Path& path) {
+	auto isStart = [&](int x, int y) {
+		return (map[x][y].parentX == x && map[x][y].parentY == y) || map[x][y].x == -1 || map[x][y].y == -1;
+	};
+	auto openCorner = [&](int x, int y, int& cornerX, int& cornerY) {
+		int parentX = map[x][y].parentX;
+		int parentY = map[x][y].parentY;
+		if (x == parentX || y == parentY) return false;
+		cornerX = isValid(x, parentY, m) ? x : parentX;
+		cornerY = isValid(x, parentY, m) ? parentY : y;
+		return isValid(cornerX, cornerY, m);
+	};
+
+	int steps = 0;
+	int cornerX, cornerY;
+	for (int x = destination.x, y = destination.y; !isStart(x, y);) {
+		steps += openCorner(x, y, cornerX, cornerY) ? 2 : 1;
+		int tempX = map[x][y].parentX;
+		int tempY = map[x][y].parentY;
+		x = tempX;
+		y = tempY;
+	}
+
+	path.directions = arenaArray<uint64_t>(scratch, steps / pathStepsPerWord + 1);
+	int step = steps;
+	auto putStep = [&](int dx, int dy) {
+		step--;
+		path.directions[step / pathStepsPerWord] |= (uint64_t)pathDirection(dx, dy) << (step % pathStepsPerWord * 3);
+	};
+	int x = destination.x;
+	int y = destination.y;
+	while (!isStart(x, y)) {
+		int parentX = map[x][y].parentX;
+		int parentY = map[x][y].parentY;
+		if (openCorner(x, y, cornerX, cornerY)) {
+			putStep(x - cornerX, y - cornerY);
+			putStep(cornerX - parentX, cornerY - parentY);
+		}
+		else
+			putStep(x - parentX, y - parentY);
+		x = parentX;
+		y = parentY;
+	}
+	path.startX = x;
+	path.startY = y;
+	path.length = steps + 1;
+}
+
+// Leaves the path in `path` (empty if there is none). Everything, the path included, is allocated
+// from `scratch`, which the caller rewinds between searches; searchScratchBytes always fits.
+void aStar(const Map& map, Node start, Node destination, Arena& scratch, Path& path) {
+	TraceSpan span("aStar", start.x, start.y);
+	path = Path();
+	if (!isValid(destination.x, destination.y, map)) return;
+	if (isDestination(start.x, start.y, destination)) return;
+
+	// indexed [x][y] like the rest of the search
+	Grid<bool> closedList = arenaGrid<bool>(scratch, map.sizeY, map.sizeX);
+	Grid<Node> allMap = arenaGrid<Node>(scratch, map.sizeY, map.sizeX);
+	for (int x = 0; x < map.sizeX; x++)
+		for (int y = 0; y < map.sizeY; y++) {
+			allMap[x][y].x = x;
+			allMap[x][y].y = y;
+		}
+	int x = start.x;
+	int y = start.y;
+
+	allMap[x][y].fCost = 0.0;
+	allMap[x][y].gCost = 0.0;
+	allMap[x][y].hCost = 0.0;
+	allMap[x][y].parentX = x;
+	allMap[x][y].parentY = y;
+
+	// the search stops once the list holds a node per tile, and a step adds at most 8
+	int openCapacity = map.sizeX * map.sizeY + 8;
+	Node* openList = (Node*)arenaAlloc(scratch, sizeof(Node) * openCapacity, alignof(Node));
+	int openCount = 0;
+	openList[openCount++] = allMap[x][y];
+
+	while (openCount > 0 && openCount < map.sizeX * map.sizeY) {
+		Node node;
+		do {
+			float temp = FLT_MAX;
+			int itNode = 0;
+			for (int i = 0; i < openCount; i++) {
+				if (openList[i].fCost < temp) {
+					temp = openList[i].fCost;
+					itNode = i;
+				}
+			}
+			node = openList[itNode];
+			memmove(&openList[itNode], &openList[itNode + 1], sizeof(Node) * (openCount - itNode - 1));
+			openCount--;
+		} while (!isValid(node.x, node.y, map));
+
+		x = node.x;
+		y = node.y;
+		closedList[x][y] = true;
+
+		for (int nX = -1; nX <= 1; nX++)
+			for (int nY = -1; nY <= 1; nY++)
+			{
+				double gNew, hNew, fNew;
+				if (isValid(x + nX, y + nY, map))
+					if (isDestination(x + nX, y + nY, destination)) {
+						allMap[x + nX][y + nY].parentX = x;
+						allMap[x + nX][y + nY].parentY = y;
+
+						makePath(allMap, destination, map, scratch, path);
+						return;
+					}
+					else if (!closedList[x + nX][y + nY]) {
+						gNew = node.gCost + 1.0;
+						hNew = calculateH(x + nX, y + nY, destination);
+						fNew = gNew + hNew;
+
+						if (allMap[x + nX][y + nY].fCost == FLT_MAX || allMap[x + nX][y + nY].fCost > fNew) {
+							allMap[x + nX][y + nY].fCost = fNew;
+							allMap[x + nX][y + nY].gCost = gNew;
+							allMap[x + nX][y + nY].hCost = hNew;
+							allMap[x + nX][y + nY].parentX = x;
+							allMap[x + nX][y + nY].parentY = y;
+
+							openList[openCount++] = allMap[x + nX][y + nY];
+						}
+					}
+			}
+	}
+}
+
+// Every tile a corridor runs through, a bit each. Bits are only ever set, so workers stamp their
+// paths into it as each search completes and it comes out the same whatever order they finish in.
+struct CorridorBits {
+	int words{}; // per row
+	atomic<uint64_t>* cells = nullptr;
+};
+
+constexpr size_t corridorBitsBytes(int sizeX, int sizeY) {
+	return sizeof(atomic<uint64_t>) * ((size_t)(sizeX + 63) / 64 * sizeY) + alignof(atomic<uint64_t>);
+}
+
+// Cleared, nullptr cells once the caller's memory is used up.
+CorridorBits makeCorridorBits(Arena& arena, int sizeX, int sizeY) {
+	CorridorBits bits;
+	bits.words = (sizeX + 63) / 64;
+	size_t count = (size_t)bits.words * sizeY;
+	bits.cells = (atomic<uint64_t>*)arenaAlloc(arena, sizeof(atomic<uint64_t>) * count, alignof(atomic<uint64_t>));
+	if (bits.cells)
+		for (size_t i = 0; i < count; i++) new (&bits.cells[i]) atomic<uint64_t>(0);
+	return bits;
+}
+
+void stampPath(const CorridorBits& corridors, const Path& path) {
+	TraceSpan span("stampPath", path.startX, path.startY);
+	if (path.length == 0) return;
+	int x = path.startX;
+	int y = path.startY;
+	for (int step = 0;; step++) {
+		corridors.cells[(size_t)y * corridors.words + x / 64].fetch_or(1ull << (x % 64), memory_order_relaxed);
+		if (step == path.length - 1) break;
+		int code = pathStep(path, step);
+		x += pathStepX[code];
+		y += pathStepY[code];
+	}
+}
+
+// Work stealing for the corridor searches. Every worker starts with a contiguous share of the
+// doors and takes them front to back; once its share is gone it steals from the back of the others'.
+struct RouteQueue {
+	mutex m;
+	int next{}, end{};
+};
+
+bool takeRoute(RouteQueue& queue, int& door) {
+	lock_guard<mutex> lock(queue.m);
+	if (queue.next >= queue.end) return false;
+	door = queue.next++;
+	return true;
+}
+
+bool stealRoute(RouteQueue& queue, int& door) {
+	lock_guard<mutex> lock(queue.m);
+	if (queue.next >= queue.end) return false;
+	door = --queue.end;
+	return true;
+}
+
+// One search's worth of scratch, reused by rewinding after every door. Carved out of the map's
+// arena when that is caller memory, its own blocks otherwise. False if the caller's is too small.
+bool makeSearchScratch(Map& map, Arena& scratch) {
+	size_t bytes = searchScratchBytes(map.sizeX, map.sizeY);
+	if (map.arena.lent) {
+		void* memory = arenaAlloc(map.arena, bytes, alignof(max_align_t));
+		if (!memory) return false;
+		arenaAttach(scratch, memory, bytes);
+		return true;
+	}
+	scratch.account = map.memory;
+	scratch.subsystem = PATHFINDING_MEMORY;
+	scratch.blockSize = bytes;
+	return arenaReserve(scratch, bytes);
+}
+
+// Routes the door on tile y * sizeX + x to the closest door of another room and stamps the
+// corridor. Returns its length, 0 without searching if `reach` puts the doors apart.
+int routeDoor(const Map& map, int tile, const int* reach, Arena& scratch, const CorridorBits& corridors) {
+	Node door;
+	door.x = tile % map.sizeX;
+	door.y = tile / map.sizeX;
+	Node closestDoor = findClosestDoor(map, door.x, door.y);
+	if (reach[tile] != reach[closestDoor.y * map.sizeX + closestDoor.x]) return 0;
+	ArenaMark mark = arenaMark(scratch);
+	Path path;
+	aStar(map, door, closestDoor, scratch, path);
+	stampPath(corridors, path);
+	arenaRewind(scratch, mark);
+	return path.length;
+}
+
+// Searches only read the map, so any worker may route any door.
+void routeDoors(const Map& map, const int* doors, const int* reach, const CorridorBits& corridors, vector<RouteQueue>& queues, int worker,
+	Arena& scratch, int& corridorLength) {
+	int workers = (int)queues.size();
+	int door;
+	for (;;) {
+		bool found = takeRoute(queues[worker], door);
+		for (int i = 1; !found && i < workers; i++)
+			found = stealRoute(queues[(worker + i) % workers], door);
+		if (!found) return;
+		corridorLength += routeDoor(map, doors[door], reach, scratch, corridors);
+	}
+}
+
+// A corridor tile turns the open space around it into corridor wall unless another corridor runs
+// there, so the grid comes out the same whichever tile is carved first.
+void carveCorridors(Map& map, const CorridorBits& corridors) {
+	TraceSpan span("carveCorridors");
+	for (int y = 0; y < map.sizeY; y++)
+		for (int w = 0; w < corridors.words; w++) {
+			uint64_t bits = corridors.cells[(size_t)y * corridors.words + w].load(memory_order_relaxed);
+			for (; bits; bits &= bits - 1) {
+				int x = w * 64 + lowestBit(bits);
+				for (int i = -1; i <= 1; i++) {
+					for (int j = -1; j <= 1; j++) {
+						if (j == 0 && i == 0) {
+							map.tileArray[y + j][x + i] = ROOM_AIR;
+							continue;
+						}
+						if (map.tileArray[y + j][x + i] != AIR) continue;
+						map.tileArray[y + j][x + i] = CORRIDOR_WALL;
+					}
+				}
+			}
+		}
+}
+
+// Returns the total length of all corridors found, -1 if they don't fit the caller's memory (see generateDungeon).
+// Every search clears a node grid over the whole map, about 58 bytes a tile per routing thread, so
+// each door costs the map's area whatever its corridor's length; see maxMapSide for what that allows.
+int connectRooms(Map& map) {
+	TraceSpan span("connectRooms");
+	int corridorLength = 0;
+
+	if (map.verbose) cout << "Connecting rooms..." << endl;
+	int doorCount = 0;
+	for (int y = 0; y < map.sizeY; y++)
+		for (int x = 0; x < map.sizeX; x++)
+			doorCount += map.tileArray[y][x] == DOOR;
+	// cave floors have none
+	if (doorCount == 0) {
+		if (map.verbose) cout << "end" << endl;
+		return 0;
+	}
+	int* doors = arenaArray<int>(map.arena, doorCount);
+	CorridorBits corridors = makeCorridorBits(map.arena, map.sizeX, map.sizeY);
+	int* reach = arenaArray<int>(map.arena, (size_t)map.sizeX * map.sizeY);
+	ArenaMark mark = arenaMark(map.arena);
+	int* stack = arenaArray<int>(map.arena, (size_t)map.sizeX * map.sizeY);
+	if (!doors || !corridors.cells || !reach || !stack) return -1;
+	int door = 0;
+	for (int y = 0; y < map.sizeY; y++)
+		for (int x = 0; x < map.sizeX; x++)
+			if (map.tileArray[y][x] == DOOR) doors[door++] = y * map.sizeX + x;
+
+	// searches step onto AIR and DOOR in all eight directions and never past the sealed border, so
+	// a door whose closest door lies in another patch of them would only search its own patch dry
+	fill_n(reach, (size_t)map.sizeX * map.sizeY, noRegion);
+	labelComponents(reach, stack, map.sizeX, map.sizeY, true, 0, [&](int x, int y) { return isValid(x, y, map); });
+	arenaRewind(map.arena, mark);
+
+	int workers = threadCount(map.routingThreads, doorCount);
+	if (workers == 1) {
+		Arena scratch;
+		if (!makeSearchScratch(map, scratch)) return -1;
+		for (int d = 0; d < doorCount; d++)
+			corridorLength += routeDoor(map, doors[d], reach, scratch, corridors);
+	}
+	else {
+		vector<Arena> scratches(workers);
+		vector<int> lengths(workers);
+		vector<RouteQueue> queues(workers);
+		for (int w = 0; w < workers; w++) {
+			queues[w].next = doorCount * w / workers;
+			queues[w].end = doorCount * (w + 1) / workers;
+			if (!makeSearchScratch(map, scratches[w])) return -1;
+		}
+		vector<thread> threads;
+		for (int w = 1; w < workers; w++)
+			threads.emplace_back(routeDoors, cref(map), doors, reach, cref(corridors), ref(queues), w, ref(scratches[w]), ref(lengths[w]));
+		routeDoors(map, doors, reach, corridors, queues, 0, scratches[0], lengths[0]);
+		for (thread& t : threads) t.join();
+		for (int length : lengths) corridorLength += length;
+	}
+
+	if (map.verbose) cout << "Generating paths..." << endl;
+	carveCorridors(map, corridors);
+
+	if (map.verbose) cout << "end" << endl;
+	return corridorLength;
+}
+
+
+// ----------[ LIBRARY ]--------------
+// Generation for embedding: a floor goes into buffers the caller owns. Nothing else is allocated,
+// no state outlives the call and nothing is printed, so any number of threads can generate at
+// once. Build with -DCMDUNGEON_LIBRARY to leave main() out.
+
+// What a floor needs, see dungeonSizes.
+struct DungeonSizes {
+	int sizeX{}, sizeY{};
+	size_t tiles{};        // sizeX * sizeY
+	int rooms{};           // the most rooms the params can produce
+	size_t scratchBytes{}; // room hash, door list, routing labels, corridor search and corridor bits
+};
+
+struct DungeonBuffers {
+	Tile* tiles = nullptr; // row by row, before normalizeTiles: doors, room floors and corridor walls are kept apart
+	size_t tileCount{};
+	Room* rooms = nullptr; // row by row for lattice placement, in placement order for scattered
+	int roomCapacity{};
+	void* scratch = nullptr;
+	size_t scratchBytes{};
+};
+
+// A room has at most four doors, and every corridor is stamped into a bit per tile as soon as it
+// is found, so the scratch asked for always fits. Routing also labels the tiles it can search.
+constexpr DungeonSizes dungeonSizes(const MapParams& params) {
+	DungeonSizes sizes;
+	sizes.sizeX = params.roomsX * Room::maxSizeX;
+	sizes.sizeY = params.roomsY * Room::maxSizeY;
+	sizes.tiles = (size_t)sizes.sizeX * sizes.sizeY;
+	sizes.rooms = maxRoomCount(params);
+	size_t doors = 4 * (size_t)sizes.rooms;
+	if (params.placement == CAVE_PLACEMENT)
+		sizes.scratchBytes = caveScratchBytes(sizes.sizeX, sizes.sizeY) + 8 * alignof(max_align_t);
+	else
+		sizes.scratchBytes = roomHashBytes(params) + searchScratchBytes(sizes.sizeX, sizes.sizeY) + doors * sizeof(int) +
+			corridorBitsBytes(sizes.sizeX, sizes.sizeY) + 2 * sizes.tiles * sizeof(int) + 8 * alignof(max_align_t);
+	return sizes;
+}
+
+// Generates the floor params describe into buffers, connected and with its border sealed, and
+// sets roomCount. params.verbose, memory and the thread counts are ignored. False if the size isn't
+// mapSizeValid or a buffer is smaller than dungeonSizes asks for.
+bool generateDungeon(const MapParams& params, const DungeonBuffers& buffers, int& roomCount) {
+	roomCount = 0;
+	if (!mapSizeValid(params)) return false;
+	DungeonSizes sizes = dungeonSizes(params);
+	if (!buffers.tiles || buffers.tileCount < sizes.tiles || (sizes.rooms && !buffers.rooms) || buffers.roomCapacity < sizes.rooms ||
+		!buffers.scratch || buffers.scratchBytes < sizes.scratchBytes)
+		return false;
+
+	MapParams quiet = params;
+	quiet.verbose = false;
+	quiet.memory = nullptr;
+	quiet.routingThreads = 1;
+	quiet.caveThreads = 1;
+	Map map;
+	setupMap(map, quiet);
+	fill_n(buffers.tiles, sizes.tiles, AIR);
+	map.tileArray.cells = buffers.tiles;
+	map.tileArray.sizeX = map.sizeX;
+	map.tileArray.sizeY = map.sizeY;
+	map.rooms = buffers.rooms;
+
+	size_t hashBytes = roomHashBytes(quiet) + alignof(max_align_t);
+	arenaAttach(map.roomArena, buffers.scratch, hashBytes);
+	arenaAttach(map.arena, (unsigned char*)buffers.scratch + hashBytes, buffers.scratchBytes - hashBytes);
+	if (!layoutRooms(map)) return false;
+	roomCount = map.roomCount;
+	return connectRooms(map) >= 0;
+}
+
+template <int RoomsX, int RoomsY, Placement P>
+constexpr MapParams staticDungeonParams() {
+	MapParams params;
+	params.roomsX = RoomsX;
+	params.roomsY = RoomsY;
+	params.placement = P;
+	return params;
+}
+
+// Storage for a floor whose configuration is fixed at compile time: everything generateDungeon
+// needs, sized by dungeonSizes and held inline. Put one in static storage, or reuse one per
+// thread, and generating a floor touches no other memory. Only the storage is fixed, the floor
+// is generated by the same code as any other.
+template <int RoomsX, int RoomsY, Placement P = LATTICE_PLACEMENT>
+struct StaticDungeon {
+	static_assert(mapSizeValid(staticDungeonParams<RoomsX, RoomsY, P>()), "no such floor, see mapSizeValid");
+	static constexpr DungeonSizes sizes = dungeonSizes(staticDungeonParams<RoomsX, RoomsY, P>());
+	static constexpr int sizeX = sizes.sizeX, sizeY = sizes.sizeY;
+
+	Tile tiles[sizes.tiles];
+	Room rooms[sizes.rooms > 0 ? sizes.rooms : 1];
+	alignas(max_align_t) unsigned char scratch[sizes.scratchBytes];
+	int roomCount{};
+
+	Tile tile(int x, int y) const { return tiles[y * sizeX + x]; }
+};
+
+// Generates seed's floor of dungeon's configuration into it, see generateDungeon above.
+template <int RoomsX, int RoomsY, Placement P>
+bool generateDungeon(StaticDungeon<RoomsX, RoomsY, P>& dungeon, unsigned int seed) {
+	MapParams params = staticDungeonParams<RoomsX, RoomsY, P>();
+	params.seed = seed;
+	DungeonBuffers buffers;
+	buffers.tiles = dungeon.tiles;
+	buffers.tileCount = dungeon.sizes.tiles;
+	buffers.rooms = dungeon.rooms;
+	buffers.roomCapacity = dungeon.sizes.rooms;
+	buffers.scratch = dungeon.scratch;
+	buffers.scratchBytes = dungeon.sizes.scratchBytes;
+	return generateDungeon(params, buffers, dungeon.roomCount);
+}
+
+// ----------[ RAY CASTER ]--------------
+// https://www.youtube.com/watch?v=gYRrGTC7GtA
+
+#define PI 3.14159265359
+#define P2 PI/2
+#define P3 3*PI/2
+#define DEG 0.0174533
+
+struct RayHit {
+	float dist{};
+	char c = ' ';
+	int mx = -1, my = -1;
+};
+
+// Grid crossings a ray is followed for on each axis. The distance field both finds the walls (they
+// are the tiles at distance 0) and says how many crossings a ray can leap, so open space costs one
+// lookup per leap rather than a tile store search per crossing.
+const int maxRayCrossings = 64;
+
+RayHit castRay(const Map& map, const Player& player, float ra) {
+	int mx{}, my{}, dof{};
+	float rx{}, ry{}, xo{}, yo{};
+
+	// HORIZONTAL
+	dof = 0;
+	float disH = INT_MAX, hx = player.x, hy = player.y;
+	int hmx = -1, hmy = -1;
+
+	float aTan = -1 / tan(ra);
+	if (ra < PI) {
+		ry = (((int)player.y >> tileShift) << tileShift) + tileSize;
+		rx = (player.y - ry) * aTan + player.x;
+		yo = tileSize; xo = -yo * aTan;
+	}
+	if (ra > PI) {
+		ry = (((int)player.y >> tileShift) << tileShift) - 0.0001;
+		rx = (player.y - ry) * aTan + player.x;
+		yo = -tileSize; xo = -yo * aTan;
+	}
+	if (ra == 0 || ra == PI) {
+		rx = player.x; ry = player.y; dof = maxRayCrossings;
+	}
+	int perTile = crossingsPerTile(xo);
+	while (dof < maxRayCrossings) {
+		mx = (int)(rx) >> tileShift;
+		my = (int)(ry) >> tileShift;
+		// past the edge it never comes back, the map is convex
+		if (my < 0 || mx < 0 || my >= map.sizeY || mx >= map.sizeX) break;
+		int d = map.wallDistance.dist[(size_t)my * map.sizeX + mx];
+		if (d == 0) {
+			hx = rx; hy = ry; hmx = mx; hmy = my;
+			disH = dist(player.x, player.y, hx, hy);
+			break;
+		}
+		int leap = rayLeap(d, perTile);
+		rx += leap * xo; ry += leap * yo; dof += leap;
+	}
+
+	// VERTICAL
+	dof = 0;
+	float disV = INT_MAX, vx = player.x, vy = player.y;
+	int vmx = -1, vmy = -1;
+
+	float nTan = -tan(ra);
+	if (ra < P2 || ra > P3) {
+		rx = (((int)player.x >> tileShift) << tileShift) + tileSize;
+		ry = (player.x - rx) * nTan + player.y;
+		xo = tileSize; yo = -xo * nTan;
+	}
+	if (ra > P2 && ra < P3) {
+		rx = (((int)player.x >> tileShift) << tileShift) - 0.0001;
+		ry = (player.x - rx) * nTan + player.y;
+		xo = -tileSize; yo = -xo * nTan;
+	}
+	if (ra == P2 || ra == P3) {
+		rx = player.x; ry = player.y; dof = maxRayCrossings;
+	}
+	perTile = crossingsPerTile(yo);
+	while (dof < maxRayCrossings) {
+		mx = (int)(rx) >> tileShift;
+		my = (int)(ry) >> tileShift;
+		// past the edge it never comes back, the map is convex
+		if (my < 0 || mx < 0 || my >= map.sizeY || mx >= map.sizeX) break;
+		int d = map.wallDistance.dist[(size_t)my * map.sizeX + mx];
+		if (d == 0) {
+			vx = rx; vy = ry; vmx = mx; vmy = my;
+			disV = dist(player.x, player.y, vx, vy);
+			break;
+		}
+		int leap = rayLeap(d, perTile);
+		rx += leap * xo; ry += leap * yo; dof += leap;
+	}
+
+	RayHit hit;
+	if (disV < disH) { hit.dist = disV; hit.c = '#'; hit.mx = vmx; hit.my = vmy; }
+	if (disH < disV) { hit.dist = disH; hit.c = '*'; hit.mx = hmx; hit.my = hmy; }
+
+	float ca = player.angle - ra;
+	if (ca < 0) ca += 2 * PI;
+	if (ca > 2 * PI) ca -= 2 * PI;
+
+	hit.dist *= cos(ca) + 0.0001;
+	return hit;
+}
+
+float rayAngle(const view& v, const Player& player, int column) {
+	float ra = player.angle - DEG * v.sizeX / 2 + DEG * column;
+	if (ra < 0) ra += 2 * PI;
+	if (ra > 2 * PI) ra -= 2 * PI;
+	return ra;
+}
+
+// Wall character for the face that was hit, darker the less light falls on the wall tile.
+char shadeWall(const Map& map, const RayHit& hit) {
+	static const char shades[2][4] = { { '#', '=', ':', '.' }, { '*', '+', '-', ',' } };
+	if (hit.c == ' ') return ' ';
+	int level = lightAt(map.lights, hit.mx, hit.my);
+	int shade = level >= 160 ? 0 : level >= 96 ? 1 : level >= 48 ? 2 : 3;
+	return shades[hit.c == '*'][shade];
+}
+
+int wallHeight(const view& v, const RayHit& hit) {
+	if (hit.c == ' ') return 0;
+	int lineH = (tileSize * v.sizeY) / hit.dist;
+	if (lineH > v.sizeY) lineH = v.sizeY;
+	return lineH;
+}
+
+float hitDepth(const RayHit& hit) {
+	return hit.c == ' ' ? FLT_MAX : hit.dist;
+}
+
+// Two samples lie on the same straight stretch of wall if they hit the same face of neighbouring tiles.
+bool hitsAgree(const RayHit& a, const RayHit& b) {
+	if (a.c != b.c) return false;
+	if (a.c == '*') return a.my == b.my && abs(a.mx - b.mx) <= 1;
+	if (a.c == '#') return a.mx == b.mx && abs(a.my - b.my) <= 1;
+	return true;
+}
+
+// Frame budget governor: over budget cast every 2nd, then every 4th column,
+// go back to full resolution once the raycast fits comfortably again.
+void updateRayStep(view& v, float frameMs) {
+	if (frameMs > v.frameBudgetMs && v.rayStep < 4)
+		v.rayStep *= 2;
+	else if (frameMs < v.frameBudgetMs / 3 && v.rayStep > 1)
+		v.rayStep /= 2;
+}
+
+// Floor tiles inside a room rectangle, corridors and the open space between rooms are everything else.
+bool isRoomFloor(const Map& map, int x, int y) {
+	const Room* room = getRoomFromMapCoords(map, x, y);
+	if (!room) return false;
+	int roomX = x - room->left;
+	int roomY = y - room->top;
+	return roomX > 0 && roomY > 0 && roomX < room->sizeX - 1 && roomY < room->sizeY - 1;
+}
+
+// Floor and ceiling, one screen row at a time. Every cell of a row sees the floor at the same
+// perpendicular distance, so its world position is the player position plus that distance times
+// the column direction: one multiply-add per cell over arrays, no per-cell trigonometry.
+// Ceiling rows are flat and are filled without touching the map at all.
+void castFloors(view& v, const Map& map, const Player& player) {
+	// none of these is a wall shade, so a dim wall never blends into the floor in front of it
+	static const char roomFloor[2] = { '_', ' ' }, corridorFloor[2] = { '~', ' ' }, ceiling[2] = { '\'', ' ' };
+	const float nearDistance = 4.0f * tileSize;
+	int horizon = v.sizeY / 2;
+
+	v.floorDirX.resize(v.sizeX); v.floorDirY.resize(v.sizeX);
+	v.floorTileX.resize(v.sizeX); v.floorTileY.resize(v.sizeX);
+	for (int r = 0; r < v.sizeX; r++) {
+		float ra = rayAngle(v, player, r);
+		float scale = 1 / cos(player.angle - ra);
+		v.floorDirX[r] = cos(ra) * scale;
+		v.floorDirY[r] = sin(ra) * scale;
+	}
+
+	float* dirX = v.floorDirX.data(); float* dirY = v.floorDirY.data();
+	int* tileX = v.floorTileX.data(); int* tileY = v.floorTileY.data();
+	for (int y = 0; y < v.sizeY; y++) {
+		char* row = v.viewArray[y].data();
+		// a wall of tileSize fills tileSize * sizeY / dist rows centred on the horizon
+		float rowOffset = y < horizon ? horizon - y - 0.5f : y - horizon + 0.5f;
+		float rowDistance = tileSize * v.sizeY / (2 * rowOffset);
+		int distant = rowDistance >= nearDistance;
+
+		if (y < horizon || distant) {
+			memset(row, y < horizon ? ceiling[distant] : roomFloor[distant], v.sizeX);
+			continue;
+		}
+		for (int r = 0; r < v.sizeX; r++) {
+			tileX[r] = (int)(player.x + rowDistance * dirX[r]) >> tileShift;
+			tileY[r] = (int)(player.y + rowDistance * dirY[r]) >> tileShift;
+		}
+		for (int r = 0; r < v.sizeX; r++)
+			row[r] = isRoomFloor(map, tileX[r], tileY[r]) ? roomFloor[distant] : corridorFloor[distant];
+	}
+}
+
+void castRays(view& v, const Map& map, const Player& player) {
+	TraceSpan span("castRays");
+	auto start = chrono::steady_clock::now();
+	castFloors(v, map, player);
+	v.depth.assign(v.sizeX, FLT_MAX);
+	if (v.sizeX <= 0) return;
+
+	RayHit prev = castRay(map, player, rayAngle(v, player, 0));
+	placeColumn(v, 0, wallHeight(v, prev), shadeWall(map, prev));
+	v.depth[0] = hitDepth(prev);
+	for (int r0 = 0; r0 < v.sizeX - 1; r0 += v.rayStep)
+	{
+		int r1 = min(r0 + v.rayStep, v.sizeX - 1);
+		RayHit next = castRay(map, player, rayAngle(v, player, r1));
+		int h0 = wallHeight(v, prev), h1 = wallHeight(v, next);
+
+		// interpolate the skipped columns along a continuous wall, cast them exactly around edges
+		bool agree = hitsAgree(prev, next);
+		for (int r = r0 + 1; r < r1; r++) {
+			if (agree) {
+				placeColumn(v, r, h0 + (h1 - h0) * (r - r0) / (r1 - r0), shadeWall(map, prev));
+				if (prev.c != ' ')
+					v.depth[r] = prev.dist + (next.dist - prev.dist) * (r - r0) / (r1 - r0);
+				continue;
+			}
+			RayHit hit = castRay(map, player, rayAngle(v, player, r));
+			placeColumn(v, r, wallHeight(v, hit), shadeWall(map, hit));
+			v.depth[r] = hitDepth(hit);
+		}
+		placeColumn(v, r1, h1, shadeWall(map, next));
+		v.depth[r1] = hitDepth(next);
+		prev = next;
+	}
+
+	updateRayStep(v, chrono::duration<float, milli>(chrono::steady_clock::now() - start).count());
+}
+
+// ----------[ SPRITES ]--------------
+// Billboards always face the player. Only the sprite buckets within reach of the farthest wall on
+// screen are looked at, sprites behind the player, off screen or fully behind walls are dropped
+// before sorting, and the rest are drawn far to near, column by column where they are nearer than
+// the wall castRays found.
+
+const float spriteDrawDistance = 24.0f * tileSize;
+
+void addSprite(Map& map, const Sprite& sprite) {
+	SpriteIndex& index = map.spriteIndex;
+	int bX = clamp((int)(sprite.x / tileSize) / SpriteIndex::bucketSize, 0, index.bucketsX - 1);
+	int bY = clamp((int)(sprite.y / tileSize) / SpriteIndex::bucketSize, 0, index.bucketsY - 1);
+	index.buckets[(size_t)bY * index.bucketsX + bX].push_back((int)map.sprites.size());
+	map.sprites.push_back(sprite);
+}
+
+// A torch in the middle of every room, where bakeLights puts its light, and a door in every doorway.
+void placeSprites(Map& map) {
+	SpriteIndex& index = map.spriteIndex;
+	index.bucketsX = (map.sizeX + SpriteIndex::bucketSize - 1) / SpriteIndex::bucketSize;
+	index.bucketsY = (map.sizeY + SpriteIndex::bucketSize - 1) / SpriteIndex::bucketSize;
+	index.buckets.assign((size_t)index.bucketsX * index.bucketsY, {});
+	map.sprites.clear();
+
+	for (const Room& room : allRooms(map)) {
+		Sprite torch;
+		torch.x = (room.left + room.sizeX / 2 + 0.5f) * tileSize;
+		torch.y = (room.top + room.sizeY / 2 + 0.5f) * tileSize;
+		torch.scale = 0.4f;
+		torch.c = 'i';
+		addSprite(map, torch);
+		for (int d = 0; d < room.doorCount; d++) {
+			Sprite door;
+			door.x = (room.doorX[d] + 0.5f) * tileSize;
+			door.y = (room.doorY[d] + 0.5f) * tileSize;
+			door.scale = 0.9f;
+			door.c = '%';
+			addSprite(map, door);
+		}
+	}
+}
+
+void drawSprites(view& v, const Map& map, const Player& player) {
+	const SpriteIndex& index = map.spriteIndex;
+	if (index.buckets.empty() || (int)v.depth.size() != v.sizeX) return;
+
+	v.visibleSprites.clear();
+	// straight line distance to the farthest wall on screen, nothing beyond it can show
+	float reach = 0;
+	for (int x = 0; x < v.sizeX; x++) {
+		float c = cos(DEG * (x - v.sizeX / 2));
+		reach = max(reach, c > 0.01f ? v.depth[x] / c : FLT_MAX);
+	}
+	reach = min(reach, spriteDrawDistance);
+
+	int range = (int)(reach / tileSize) / SpriteIndex::bucketSize + 1;
+	int pX = (int)(player.x / tileSize) / SpriteIndex::bucketSize;
+	int pY = (int)(player.y / tileSize) / SpriteIndex::bucketSize;
+	for (int bY = max(pY - range, 0); bY <= min(pY + range, index.bucketsY - 1); bY++)
+		for (int bX = max(pX - range, 0); bX <= min(pX + range, index.bucketsX - 1); bX++)
+			for (int i : index.buckets[(size_t)bY * index.bucketsX + bX]) {
+				const Sprite& sprite = map.sprites[i];
+				float dX = sprite.x - player.x, dY = sprite.y - player.y;
+				float angle = atan2(dY, dX) - player.angle;
+				while (angle > PI) angle -= 2 * PI;
+				while (angle < -PI) angle += 2 * PI;
+				if (fabs(angle) >= P2) continue;
+				float depth = sqrt(dX * dX + dY * dY) * cos(angle);
+				if (depth < tileSize / 2 || depth > reach) continue;
+				int halfWidth = (int)(tileSize * v.sizeY * sprite.scale / depth) / 2;
+				int column = (int)(angle / DEG) + v.sizeX / 2;
+				bool visible = false;
+				for (int x = max(column - halfWidth, 0); x <= min(column + halfWidth, v.sizeX - 1) && !visible; x++)
+					visible = v.depth[x] > depth;
+				if (visible) v.visibleSprites.push_back({ depth, column, i });
+			}
+	sort(v.visibleSprites.begin(), v.visibleSprites.end(), [](const VisibleSprite& a, const VisibleSprite& b) { return a.depth > b.depth; });
+
+	for (const VisibleSprite& visible : v.visibleSprites) {
+		const Sprite& sprite = map.sprites[visible.index];
+		float depth = visible.depth;
+		int column = visible.column;
+
+		// standing on the floor line castFloors draws at this distance
+		int height = max((int)(tileSize * v.sizeY * sprite.scale / depth), 1);
+		int bottom = (v.sizeY + (int)(tileSize * v.sizeY / depth)) / 2;
+		int top = max(bottom - height, 0);
+		bottom = min(bottom, v.sizeY);
+		int halfWidth = height / 2;
+		for (int x = max(column - halfWidth, 0); x <= min(column + halfWidth, v.sizeX - 1); x++) {
+			if (v.depth[x] <= depth) continue;
+			for (int y = top; y < bottom; y++)
+				v.viewArray[y][x] = sprite.c;
+		}
+	}
+}
+
+// ----------[ MAIN ]--------------
+
+void drawFrame(view& v, const Map& map, const Player& player) {
+	TraceSpan span("drawFrame");
+	castRays(v, map, player);
+	drawSprites(v, map, player);
+	if (v.map) {
+		updateMinimap(v, map, player);
+		blitMinimap(v);
+	}
+}
+
+void updateLantern(Map& map, Player& player) {
+	int x = (int)(player.x / tileSize);
+	int y = (int)(player.y / tileSize);
+	if (player.lantern < 0) {
+		Light lantern;
+		lantern.x = x;
+		lantern.y = y;
+		lantern.radius = 5;
+		lantern.intensity = 200;
+		player.lantern = addLight(map.lights, lantern);
+		return;
+	}
+	moveLight(map.lights, player.lantern, x, y);
+}
+
+void handleInput(char key, Map& map, Player& player, view& v) {
+	switch (key)
+	{
+	case 'a':
+		player.angle -= 0.1;
+		if (player.angle < 0) player.angle += 2 * PI;
+		player.deltaX = cos(player.angle) * 5;
+		player.deltaY = sin(player.angle) * 5;
+		break;
+	case 'd':
+		player.angle += 0.1;
+		if (player.angle > 2 * PI) player.angle -= 2 * PI;
+		player.deltaX = cos(player.angle) * 5;
+		player.deltaY = sin(player.angle) * 5;
+		break;
+	case 'w':
+		if (getTileFromPlayerCoords(map, player.x + player.deltaX, player.y) != WALL)
+			player.x += player.deltaX;
+		if (getTileFromPlayerCoords(map, player.x, player.y + player.deltaY) != WALL)
+			player.y += player.deltaY;
+		updateLantern(map, player);
+		break;
+	case 's':
+		if (getTileFromPlayerCoords(map, player.x - player.deltaX, player.y) != WALL)
+			player.x -= player.deltaX;
+		if (getTileFromPlayerCoords(map, player.x, player.y - player.deltaY) != WALL)
+			player.y -= player.deltaY;
+		updateLantern(map, player);
+		break;
+	case 'e':
+		v.map = !v.map;
+		break;
+	case 'z':
+		v.minimapZoom = (v.minimapZoom + 1) % (int)(map.overview.levels.size() + 1);
+		break;
+	case 'f':
+	case 'b': {
+		// the tile right in front of the player, never the one they stand on
+		int x = (int)((player.x + cos(player.angle) * tileSize) / tileSize);
+		int y = (int)((player.y + sin(player.angle) * tileSize) / tileSize);
+		if (x == (int)(player.x / tileSize) && y == (int)(player.y / tileSize)) break;
+		if (key == 'f') digTile(map, x, y);
+		else buildTile(map, x, y);
+	}
+	}
 
-	for (int y = 0; y < map.sizeY; y++)
-		for (int x = 0; x < map.sizeX; x++) {
-			if (getRoomFromMapCoords(map, x, y) == getRoomFromMapCoords(map, sX, sY)) continue;
-			if (map.tileArray[y][x] != DOOR || (x == sX && y == sY)) continue;
-			if (closestDist > dist(sX, sY, x, y)) {
-				closestDist = dist(sX, sY, x, y);
-				closest.x = x;
-				closest.y = y;
-			}
-		}
+}
 
-	return closest;
+// ----------[ SAVE ]--------------
+// A floor regenerates from its seed, so a save is only the generation parameters, the tile edits
+// and the player. The file is a journal: a header, then one record per snapshot holding the edits
+// made since the previous one plus the player. The first snapshot of a session rewrites the file
+// in full, later ones are appended. Snapshots are copied on the game thread (a handful of edits and
+// a Player) and written out by the saver thread, so saving never waits on the disk.
+//
+// header: "CMD3", version, seed, roomsX, roomsY, placement          (uint32 each, little-endian)
+// record: edit count (uint32), edits (x, y: uint16, tile: uint8), player x, y, angle (float)
+
+const unsigned int saveVersion = 1;
+const chrono::seconds autosaveInterval(30);
+
+struct SaveGame {
+	MapParams params;
+	Player player;
+	vector<TileEdit> edits;
+};
+
+struct Snapshot {
+	bool full = false; // rewrite the file instead of appending
+	Player player;
+	vector<TileEdit> edits;
+};
+
+struct Saver {
+	string path;
+	MapParams params;
+
+	// game thread
+	size_t savedEdits = 0;
+	Player savedPlayer;
+	bool started = false;
+
+	// handed to the saver thread
+	mutex m;
+	condition_variable cv;
+	vector<Snapshot> pending;
+	int unwritten = 0; // snapshots taken but not on disk yet
+};
+
+void putU32(string& out, unsigned int value) {
+	for (int i = 0; i < 4; i++) out += (char)(value >> (8 * i));
 }
 
-bool isValid(int x, int y, Map map) {
-	if (x < 0 && y < 0 && x >= map.sizeX && y >= map.sizeY) return false;
-	if (map.tileArray[y][x] == AIR || map.tileArray[y][x] == DOOR) return true;
-	return false;
+void putU16(string& out, unsigned short value) {
+	for (int i = 0; i < 2; i++) out += (char)(value >> (8 * i));
 }
 
-double calculateH(int x, int y, Node dest) {
-	double H = (sqrt((x - dest.x) * (x - dest.x)
-		+ (y - dest.y) * (y - dest.y)));
-	return H;
+void putFloat(string& out, float value) {
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	putU32(out, bits);
 }
 
-bool isDestination(int x, int y, Node tile) {
-	return (tile.x == x && tile.y == y);
+unsigned int getU32(const unsigned char* in) {
+	return in[0] | in[1] << 8 | in[2] << 16 | (unsigned int)in[3] << 24;
 }
 
-vector<Node> makePath(vector<vector<Node>> map, Node destination, Map m) {
-	try {
-		int x = destination.x;
-		int y = destination.y;
-		stack<Node> path;
-		vector<Node> usablePath;
-
-		const int dx[] = { 0, -1, 0, 1 };
-		const int dy[] = { -1, 0, 1, 0 };
-
-		while (!(map[x][y].parentX == x && map[x][y].parentY == y) && map[x][y].x != -1 && map[x][y].y != -1) {
-			path.push(map[x][y]);
-			int tempX = map[x][y].parentX;
-			int tempY = map[x][y].parentY;
-			x = tempX;
-			y = tempY;
-		}
-		path.push(map[x][y]);
-
-		while (!path.empty()) {
-			Node top = path.top();
-			path.pop();
-			usablePath.emplace_back(top);
-			for (int i = 0; i < 4; i++) {
-				int newX = top.x + dx[i];
-				int newY = top.y + dy[i];
-				if (newX >= 0 && newX < m.sizeX && newY >= 0 && newY < m.sizeY &&
-					(map[newX][newY].parentX == top.x && map[newX][newY].parentY == top.y) &&
-					!(dx[i] != 0 && dy[i] != 0)) {
-					x = newX;
-					y = newY;
-					path.push(map[x][y]);
-					break;
-				}
-			}
+float getFloat(const unsigned char* in) {
+	unsigned int bits = getU32(in);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+void encodeSnapshot(const Snapshot& snapshot, string& out) {
+	putU32(out, (unsigned int)snapshot.edits.size());
+	for (const TileEdit& edit : snapshot.edits) {
+		putU16(out, edit.x);
+		putU16(out, edit.y);
+		out += (char)edit.tile;
+	}
+	putFloat(out, snapshot.player.x);
+	putFloat(out, snapshot.player.y);
+	putFloat(out, snapshot.player.angle);
+}
+
+// Saver thread. A full snapshot goes to a temporary file renamed over the old save, so a crash
+// never leaves a half written save behind; a torn appended record is dropped by readSave.
+bool writeSnapshot(const Saver& saver, const Snapshot& snapshot) {
+	string out;
+	if (snapshot.full) {
+		out += "CMD3";
+		putU32(out, saveVersion);
+		putU32(out, saver.params.seed);
+		putU32(out, (unsigned int)saver.params.roomsX);
+		putU32(out, (unsigned int)saver.params.roomsY);
+		putU32(out, (unsigned int)saver.params.placement);
+	}
+	encodeSnapshot(snapshot, out);
+
+	string target = snapshot.full ? saver.path + ".tmp" : saver.path;
+	FILE* file = fopen(target.c_str(), snapshot.full ? "wb" : "ab");
+	if (!file) return false;
+	bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok || !snapshot.full) return ok;
+#if defined(_WIN32)
+	remove(saver.path.c_str()); // rename doesn't replace an existing file on Windows
+#endif // Windows
+	return rename(target.c_str(), saver.path.c_str()) == 0;
+}
+
+void saverThread(Saver& saver) {
+	traceThreadName("saver");
+	vector<Snapshot> snapshots;
+	while (true) {
+		{
+			unique_lock<mutex> lock(saver.m);
+			saver.cv.wait(lock, [&] { return !saver.pending.empty(); });
+			snapshots.swap(saver.pending);
+		}
+		for (const Snapshot& snapshot : snapshots)
+			writeSnapshot(saver, snapshot);
+		{
+			lock_guard<mutex> lock(saver.m);
+			saver.unwritten -= (int)snapshots.size();
 		}
-		return usablePath;
+		saver.cv.notify_all();
+		snapshots.clear();
 	}
-	catch (const exception& e) {}
 }
 
-vector<Node> aStar(Map map, Node start, Node destination) {
-	vector<Node> empty;
-	if (!isValid(destination.x, destination.y, map)) return empty;
-	if (isDestination(start.x, start.y, destination)) return empty;
+// Game thread: waits until every snapshot taken so far is written.
+void flushSaves(Saver& saver) {
+	unique_lock<mutex> lock(saver.m);
+	saver.cv.wait(lock, [&] { return saver.unwritten == 0; });
+}
 
-	bool** closedList = new bool* [map.sizeX];
-	for (int i = 0; i < map.sizeX; i++)
-		closedList[i] = new bool[map.sizeY];
+// Game thread: copies what changed since the last snapshot and returns. Does nothing if nothing did.
+void takeSnapshot(const Map& map, Saver& saver) {
+	const Player& player = map.player;
+	bool moved = player.x != saver.savedPlayer.x || player.y != saver.savedPlayer.y || player.angle != saver.savedPlayer.angle;
+	if (saver.started && !moved && saver.savedEdits == map.edits.size()) return;
+
+	Snapshot snapshot;
+	snapshot.full = !saver.started;
+	snapshot.player = player;
+	snapshot.edits.assign(map.edits.begin() + (snapshot.full ? 0 : saver.savedEdits), map.edits.end());
+	saver.started = true;
+	saver.savedEdits = map.edits.size();
+	saver.savedPlayer = player;
+	{
+		lock_guard<mutex> lock(saver.m);
+		saver.pending.push_back(move(snapshot));
+		saver.unwritten++;
+	}
+	saver.cv.notify_all();
+}
 
+// Replays the whole journal. Returns false if there is no usable save at path.
+bool readSave(const string& path, SaveGame& save) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file) return false;
+	vector<unsigned char> data;
+	unsigned char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		data.insert(data.end(), buffer, buffer + n);
+	fclose(file);
+
+	const size_t headerSize = 24, editSize = 5, playerSize = 12;
+	if (data.size() < headerSize || memcmp(data.data(), "CMD3", 4) != 0 || getU32(&data[4]) != saveVersion)
+		return false;
+	save.params.seed = getU32(&data[8]);
+	save.params.roomsX = (int)getU32(&data[12]);
+	save.params.roomsY = (int)getU32(&data[16]);
+	unsigned int placement = getU32(&data[20]);
+	save.params.placement = placement == POISSON_PLACEMENT || placement == CAVE_PLACEMENT ? (Placement)placement : LATTICE_PLACEMENT;
+
+	bool havePlayer = false;
+	size_t at = headerSize;
+	while (data.size() - at >= 4) {
+		size_t count = getU32(&data[at]);
+		if (count > (data.size() - at - 4) / editSize || data.size() - at - 4 - count * editSize < playerSize) break;
+		at += 4;
+		for (size_t i = 0; i < count; i++, at += editSize)
+			save.edits.push_back({ (unsigned short)(data[at] | data[at + 1] << 8), (unsigned short)(data[at + 2] | data[at + 3] << 8), data[at + 4] });
+		save.player.x = getFloat(&data[at]);
+		save.player.y = getFloat(&data[at + 4]);
+		save.player.angle = getFloat(&data[at + 8]);
+		at += playerSize;
+		havePlayer = true;
+	}
+	return havePlayer;
+}
 
-	vector<vector<Node>> allMap;
-	for (int x = 0; x < map.sizeX; x++) {
-		vector<Node> temp;
-		for (int y = 0; y < map.sizeY; y++) {
-			Node tempNode;
-			tempNode.x = x;
-			tempNode.y = y;
+// On a map freshly generated from save.params.
+void applySave(Map& map, const SaveGame& save) {
+	for (const TileEdit& edit : save.edits)
+		if (edit.x < map.sizeX && edit.y < map.sizeY)
+			changeTile(map, edit.x, edit.y, (Tile)edit.tile);
+	map.player.x = save.player.x;
+	map.player.y = save.player.y;
+	map.player.angle = save.player.angle;
+	map.player.deltaX = cos(map.player.angle) * 5;
+	map.player.deltaY = sin(map.player.angle) * 5;
+}
+
+// ----------[ MEMORY REPORT ]--------------
+
+// Upper bound of what generating a floor with these parameters allocates: the map arena with its
+// dense grid, the A* scratch, the rooms, a worst case tile store (one run per tile), the region
+// labels and the per tile light, distance and overview data built after the arena is released.
+size_t estimateGenerationBytes(const MapParams& params) {
+	size_t sizeX = (size_t)params.roomsX * Room::maxSizeX, sizeY = (size_t)params.roomsY * Room::maxSizeY;
+	size_t area = sizeX * sizeY;
+	size_t arena = (2 * sizeof(Tile) + 2 * sizeof(int)) * area;
+	// one search's scratch for every routing thread; there are more doors than threads on any real floor
+	size_t scratch = searchScratchBytes((int)sizeX, (int)sizeY) * threadCount(params.routingThreads, (size_t)maxRoomCount(params) * 4);
+	if (params.placement == CAVE_PLACEMENT) scratch = caveScratchBytes((int)sizeX, (int)sizeY);
+	size_t tiles = sizeY * sizeof(vector<TileRun>) + area * sizeof(TileRun);
+	size_t derived = area * 3 + area / 3; // light baked + level, distance field, overview
+	// region and component labels (worst case one run per tile, like the tile store), the component
+	// sizes and labelRuns' patch runs with their labels (both at most one per two tiles)
+	size_t regions = 2 * (sizeY * sizeof(vector<LabelRun>) + area * sizeof(LabelRun)) + sizeof(int) * (area / 2 + 1) +
+		(sizeof(PatchRun) + sizeof(int)) * (area / 2 + sizeY);
+	return arena + scratch + roomStorageBytes(params) + tiles + derived + regions;
+}
 
-			closedList[x][y] = false;
+// Refuses a floor whose size mapSizeValid rejects.
+bool checkMapSize(const MapParams& params) {
+	if (mapSizeValid(params)) return true;
+	cerr << "A floor is 1 to " << maxMapSide / Room::maxSizeX << " rooms wide and 1 to " << maxMapSide / Room::maxSizeY <<
+		" rooms high, not " << params.roomsX << "x" << params.roomsY << endl;
+	return false;
+}
 
-			temp.push_back(tempNode);
-		}
-		allMap.push_back(temp);
+// Refuses a floor that would not fit the account's budget before anything is allocated.
+bool checkMemoryBudget(const MapParams& params) {
+	if (!params.memory || params.memory->budget == 0) return true;
+	size_t needed = estimateGenerationBytes(params);
+	if (needed <= params.memory->budget) return true;
+	cerr << "A " << params.roomsX << "x" << params.roomsY << " floor needs up to " << needed / 1024 << " KB, the memory budget is "
+		<< params.memory->budget / 1024 << " KB" << endl;
+	return false;
+}
+
+void measureMap(const Map& map, size_t bytes[MEMORY_SUBSYSTEMS]) {
+	bytes[TILE_MEMORY] += vectorBytes(map.tiles.rows) + vectorBytes(map.edits);
+	bytes[LIGHTING_MEMORY] += vectorBytes(map.lights.baked) + vectorBytes(map.lights.level) + vectorBytes(map.lights.dynamicLights);
+	bytes[DERIVED_MEMORY] += vectorBytes(map.wallDistance.dist) + vectorBytes(map.overview.levels) +
+		vectorBytes(map.regions.region) + vectorBytes(map.regions.component) + vectorBytes(map.regions.componentSize);
+	for (const OverviewLevel& level : map.overview.levels)
+		bytes[DERIVED_MEMORY] += vectorBytes(level.walls);
+	bytes[SPRITE_MEMORY] += vectorBytes(map.sprites) + vectorBytes(map.spriteIndex.buckets);
+}
+
+void measureView(const view& v, size_t bytes[MEMORY_SUBSYSTEMS]) {
+	bytes[VIEW_MEMORY] += vectorBytes(v.viewArray) + vectorBytes(v.minimap) + vectorBytes(v.floorDirX) + vectorBytes(v.floorDirY) +
+		vectorBytes(v.floorTileX) + vectorBytes(v.floorTileY) + vectorBytes(v.depth) + vectorBytes(v.visibleSprites);
+}
+
+// Arena backed subsystems have a live and a peak figure, the rest is what the containers hold now.
+void printMemoryReport(ostream& out, const Map& map, const view* v) {
+	size_t bytes[MEMORY_SUBSYSTEMS]{};
+	measureMap(map, bytes);
+	if (v) measureView(*v, bytes);
+
+	char line[128];
+	size_t total = 0;
+	out << "memory         live KB    peak KB" << endl;
+	for (int s = 0; s < MEMORY_SUBSYSTEMS; s++) {
+		size_t live = bytes[s] + (map.memory ? map.memory->live[s].load() : 0);
+		total += live;
+		if (s == GENERATION_MEMORY || s == PATHFINDING_MEMORY)
+			snprintf(line, sizeof(line), "%-12s %9zu  %9zu", memorySubsystemNames[s], live / 1024, map.memory ? map.memory->peak[s].load() / 1024 : 0);
+		else
+			snprintf(line, sizeof(line), "%-12s %9zu", memorySubsystemNames[s], live / 1024);
+		out << line << endl;
 	}
+	snprintf(line, sizeof(line), "%-12s %9zu", "total", total / 1024);
+	out << line << endl;
+	if (map.memory && map.memory->budget)
+		out << "budget " << map.memory->budget / 1024 << " KB, generation peaked at " << map.memory->totalPeak / 1024 << " KB" << endl;
+}
 
-	int x = start.x;
-	int y = start.y;
+// ----------[ PIPELINE ]--------------
+// Input, simulation + raycasting and terminal output each run on their own thread, so a slow
+// terminal never holds up the next key press. Keys travel through a lock-free single producer /
+// single consumer queue, frames through a triple buffer that always hands the output thread the
+// newest finished frame and silently drops the ones it didn't get to.
 
-	allMap[x][y].fCost = 0.0;
-	allMap[x][y].gCost = 0.0;
-	allMap[x][y].hCost = 0.0;
-	allMap[x][y].parentX = x;
-	allMap[x][y].parentY = y;
+struct InputQueue {
+	static constexpr unsigned size = 256;
+	char keys[size]{};
+	atomic<unsigned> head{ 0 }, tail{ 0 };
+};
 
-	vector<Node> openList;
-	openList.emplace_back(allMap[x][y]);
-	bool destinationFound = false;
+bool pushKey(InputQueue& queue, char key) {
+	unsigned tail = queue.tail.load(memory_order_relaxed);
+	if (tail - queue.head.load(memory_order_acquire) == InputQueue::size) return false;
+	queue.keys[tail % InputQueue::size] = key;
+	queue.tail.store(tail + 1, memory_order_release);
+	return true;
+}
 
-	while (!openList.empty() && openList.size() < map.sizeX * map.sizeY) {
-		Node node;
-		do {
-			float temp = FLT_MAX;
-			vector<Node>::iterator itNode;
-			for (auto i = openList.begin(); i != openList.end(); i++) {
-				Node n = *i;
-				if (n.fCost < temp) {
-					temp = n.fCost;
-					itNode = i;
-				}
-			}
-			node = *itNode;
-			openList.erase(itNode);
-		} while (!isValid(node.x, node.y, map));
+bool popKey(InputQueue& queue, char& key) {
+	unsigned head = queue.head.load(memory_order_relaxed);
+	if (head == queue.tail.load(memory_order_acquire)) return false;
+	key = queue.keys[head % InputQueue::size];
+	queue.head.store(head + 1, memory_order_release);
+	return true;
+}
 
-		x = node.x;
-		y = node.y;
-		closedList[x][y] = true;
+struct FrameRing {
+	vector<vector<char>> frames[3];
+	int back = 0, front = 1;     // owned by the simulation / output thread
+	atomic<int> middle{ 2 };     // freshFrame is set while it holds a frame the output thread hasn't taken
 
-		for (int nX = -1; nX <= 1; nX++)
-			for (int nY = -1; nY <= 1; nY++)
-			{
-				double gNew, hNew, fNew;
-				if (isValid(x + nX, y + nY, map))
-					if (isDestination(x + nX, y + nY, destination)) {
-						allMap[x + nX][y + nY].parentX = x;
-						allMap[x + nX][y + nY].parentY = y;
-						destinationFound = true;
+	static constexpr int freshFrame = 4;
+};
 
-						return makePath(allMap, destination, map);
-					}
-					else if (!closedList[x + nX][y + nY]) {
-						gNew = node.gCost + 1.0;
-						hNew = calculateH(x + nX, y + nY, destination);
-						fNew = gNew + hNew;
+void publishFrame(FrameRing& ring) {
+	ring.back = ring.middle.exchange(ring.back | FrameRing::freshFrame, memory_order_acq_rel) & 3;
+}
 
-						if (allMap[x + nX][y + nY].fCost == FLT_MAX || allMap[x + nX][y + nY].fCost > fNew) {
-							allMap[x + nX][y + nY].fCost = fNew;
-							allMap[x + nX][y + nY].gCost = gNew;
-							allMap[x + nX][y + nY].hCost = hNew;
-							allMap[x + nX][y + nY].parentX = x;
-							allMap[x + nX][y + nY].parentY = y;
+bool acquireFrame(FrameRing& ring) {
+	if (!(ring.middle.load(memory_order_acquire) & FrameRing::freshFrame)) return false;
+	ring.front = ring.middle.exchange(ring.front, memory_order_acq_rel) & 3;
+	return true;
+}
 
-							openList.emplace_back(allMap[x + nX][y + nY]);
-						}
-					}
-			}
+// Only used to sleep while there is nothing to do, no data goes through it.
+struct Wakeup {
+	mutex m;
+	condition_variable cv;
+	bool pending = false;
+};
+
+void notify(Wakeup& wakeup) {
+	{
+		lock_guard<mutex> lock(wakeup.m);
+		wakeup.pending = true;
 	}
-	if (!destinationFound) return empty;
+	wakeup.cv.notify_one();
 }
 
-void connectRooms(Map& map) {
-	vector<vector<Node>> allPaths;
+void waitFor(Wakeup& wakeup) {
+	unique_lock<mutex> lock(wakeup.m);
+	wakeup.cv.wait(lock, [&] { return wakeup.pending; });
+	wakeup.pending = false;
+}
 
-	cout << "Connecting rooms..." << endl;
-	for (int y = 0; y < map.sizeY; y++) {
-		for (int x = 0; x < map.sizeX; x++) {
-			if (map.tileArray[y][x] != DOOR) continue;
-			Node closestDoor = findClosestDoor(map, x, y);
-			Node start; start.x = x; start.y = y;
-			vector<Node> path = aStar(map, start, closestDoor);
-			allPaths.push_back(path);
-		}
-	}
-
-	cout << "Generating paths..." << endl;
-	for (const vector<Node>& path : allPaths) {
-		for (const Node& node : path) {
-			for (int i = -1; i <= 1; i++) {
-				for (int j = -1; j <= 1; j++) {
-					if (j == 0 && i == 0) {
-						map.tileArray[node.y + j][node.x + i] = ROOM_AIR;
-						continue;
-					}
-					if (map.tileArray[node.y + j][node.x + i] != AIR) continue;
-					map.tileArray[node.y + j][node.x + i] = CORRIDOR_WALL;
-				}
-			}
+char readKey() {
+	char key{};
+#if defined(_WIN32)
+	key = _getch();
+#elif defined(__linux__)
+	while (read(STDIN_FILENO, &key, 1) <= 0) {}
+#endif // Windows/Linux
+	return key;
+}
+
+void inputThread(InputQueue& queue, Wakeup& simulationWakeup) {
+	traceThreadName("input");
+	while (true) {
+		char key = readKey();
+		while (!pushKey(queue, key)) this_thread::yield();
+		notify(simulationWakeup);
+	}
+}
+
+void outputThread(FrameRing& ring, Wakeup& outputWakeup) {
+	traceThreadName("output");
+	while (true) {
+		waitFor(outputWakeup);
+		if (acquireFrame(ring))
+			writeFrame(ring.frames[ring.front]);
+	}
+}
+
+void mainLoop(view& v, Map& map, Saver& saver) {
+#if defined(__linux__)
+	struct termios old_termios, new_termios;
+	tcgetattr(STDIN_FILENO, &old_termios);
+	new_termios = old_termios;
+	new_termios.c_lflag &= ~(ICANON | ECHO);
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+#endif // Linux
+
+	InputQueue queue;
+	FrameRing ring;
+	Wakeup simulationWakeup, outputWakeup;
+	for (vector<vector<char>>& frame : ring.frames)
+		frame = v.viewArray;
+
+	thread input(inputThread, ref(queue), ref(simulationWakeup));
+	thread output(outputThread, ref(ring), ref(outputWakeup));
+	thread save(saverThread, ref(saver));
+	takeSnapshot(map, saver);
+	auto lastSave = chrono::steady_clock::now();
+
+	// simulation + render: apply every key that arrived, then draw only the resulting state
+	bool quit = false;
+	while (!quit) {
+		waitFor(simulationWakeup);
+		char key{};
+		while (!quit && popKey(queue, key)) {
+			if (key == 'q') quit = true;
+			else handleInput(key, map, map.player, v);
+		}
+		if (quit) break;
+		drawFrame(v, map, map.player);
+
+		vector<vector<char>>& frame = ring.frames[ring.back];
+		for (int y = 0; y < v.sizeY; y++)
+			frame[y].assign(v.viewArray[y].begin(), v.viewArray[y].end());
+		publishFrame(ring);
+		notify(outputWakeup);
+
+		if (chrono::steady_clock::now() - lastSave >= autosaveInterval) {
+			takeSnapshot(map, saver);
+			lastSave = chrono::steady_clock::now();
 		}
 	}
 
-	cout << "end" << endl;
+	takeSnapshot(map, saver);
+	flushSaves(saver);
+#if defined(__linux__)
+	tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
+#endif // Linux
+	cls();
+	printMemoryReport(cout, map, &v);
+
+	// the input thread is blocked reading a key it will never get; leave without unwinding the
+	// queues and wakeups the other threads still hold
+	cout.flush();
+	exit(0);
 }
 
+// ----------[ SERVER ]--------------
+// One shared Map, many terminal clients over a local Unix socket.
+// A client sends its view size (two little-endian uint16: columns, rows) followed by raw key presses.
+// The server answers with ANSI escape sequences that only redraw the cells which changed since
+// the last frame that client was sent. A view larger than maxSessionX x maxSessionY is refused.
 
-// ----------[ RAY CASTER ]--------------
-// https://www.youtube.com/watch?v=gYRrGTC7GtA
+#if defined(__linux__)
+const int maxSessionX = 1024, maxSessionY = 512;
 
-#define PI 3.14159265359
-#define P2 PI/2
-#define P3 3*PI/2
-#define DEG 0.0174533
+struct Session {
+	int fd = -1;
+	bool closed = false;
+	bool dirty = false;
+	unsigned char hello[4]{};
+	int helloLen = 0;
 
-void castRays(view& v, Map map) {
-	clearView(v);
-	int r{}, mx{}, my{}, dof{};
-	float rx{}, ry{}, ra{}, xo{}, yo{}, disT{};
+	Player player;
+	view v;
+	vector<char> sentFrame; // what the client's screen currently shows, row-major
+	string outbox;
+};
 
-	ra = map.player.angle - DEG * v.sizeX / 2;
-	if (ra < 0) ra += 2 * PI;
-	if (ra > 2 * PI) ra -= 2 * PI;
-	for (int r = 0; r < v.sizeX; r++)
-	{
-		// HORIZONTAL
-		dof = 0;
-		float disH = INT_MAX, hx = map.player.x, hy = map.player.y;
-
-		float aTan = -1 / tan(ra);
-		if (ra < PI) {
-			ry = (((int)map.player.y >> 6) << 6) + 64;
-			rx = (map.player.y - ry) * aTan + map.player.x;
-			yo = 64; xo = -yo * aTan;
-		}
-		if (ra > PI) {
-			ry = (((int)map.player.y >> 6) << 6) - 0.0001;
-			rx = (map.player.y - ry) * aTan + map.player.x;
-			yo = -64; xo = -yo * aTan;
-		}
-		if (ra == 0 || ra == PI) {
-			rx = map.player.x; ry = map.player.y; dof = 16;
-		}
-		while (dof < 16) {
-			mx = (int)(rx) >> 6;
-			my = (int)(ry) >> 6;
-			if (my >= 0 && mx >= 0 && my < map.sizeY && mx < map.sizeX && map.tileArray[my][mx] == WALL) {
-				hx = rx; hy = ry;
-				disH = dist(map.player.x, map.player.y, hx, hy);
-				break;
+void encodeFrame(const view& v, vector<char>& sentFrame, string& out) {
+	if (sentFrame.size() != (size_t)v.sizeX * v.sizeY) {
+		out += "\x1b[2J";
+		sentFrame.assign((size_t)v.sizeX * v.sizeY, '\0');
+	}
+	char move[32];
+	for (int y = 0; y < v.sizeY; y++) {
+		char* sent = &sentFrame[(size_t)y * v.sizeX];
+		const vector<char>& row = v.viewArray[y];
+		int x = 0;
+		while (x < v.sizeX) {
+			if (sent[x] == row[x]) { x++; continue; }
+			snprintf(move, sizeof(move), "\x1b[%d;%dH", y + 1, x * 2 + 1);
+			out += move;
+			for (; x < v.sizeX && sent[x] != row[x]; x++) {
+				out += ' ';
+				out += row[x];
+				sent[x] = row[x];
 			}
-			else {
-				rx += xo; ry += yo; dof += 1;
+		}
+	}
+}
+
+void readSession(Session& s, Map& map) {
+	unsigned char buffer[256];
+	ssize_t n = recv(s.fd, buffer, sizeof(buffer), 0);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) { s.closed = true; return; }
+	for (ssize_t i = 0; i < n; i++) {
+		if (s.helloLen < 4) {
+			s.hello[s.helloLen++] = buffer[i];
+			if (s.helloLen == 4) {
+				int sizeX = s.hello[0] | s.hello[1] << 8, sizeY = s.hello[2] | s.hello[3] << 8;
+				if (sizeX < 1 || sizeY < 1 || sizeX > maxSessionX || sizeY > maxSessionY) { s.closed = true; return; }
+				s.v = createView(sizeX, sizeY);
+				s.dirty = true;
 			}
+			continue;
+		}
+		handleInput((char)buffer[i], map, s.player, s.v);
+		s.dirty = true;
+	}
+}
+
+void flushSession(Session& s) {
+	while (!s.outbox.empty()) {
+		ssize_t n = send(s.fd, s.outbox.data(), s.outbox.size(), MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) s.closed = true;
+			return;
 		}
+		s.outbox.erase(0, n);
+	}
+}
 
-		// VERTICAL
-		dof = 0;
-		float disV = INT_MAX, vx = map.player.x, vy = map.player.y;
+int runServer(Map& map, const char* path) {
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (listenFd < 0 || ::bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+		perror("server");
+		return 1;
+	}
+	fcntl(listenFd, F_SETFL, O_NONBLOCK);
+	cout << "Serving on " << path << endl;
 
-		float nTan = -tan(ra);
-		if (ra < P2 || ra > P3) {
-			rx = (((int)map.player.x >> 6) << 6) + 64;
-			ry = (map.player.x - rx) * nTan + map.player.y;
-			xo = 64; yo = -xo * nTan;
+	vector<Session> sessions;
+	vector<pollfd> fds;
+	size_t seenEdits = map.edits.size();
+	while (true) {
+		fds.clear();
+		fds.push_back({ listenFd, POLLIN, 0 });
+		for (const Session& s : sessions)
+			fds.push_back({ s.fd, (short)(POLLIN | (s.outbox.empty() ? 0 : POLLOUT)), 0 });
+		if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) break;
+
+		for (size_t i = 0; i < sessions.size(); i++) {
+			short events = fds[i + 1].revents;
+			if (events & POLLIN) readSession(sessions[i], map);
+			else if (events & (POLLERR | POLLHUP)) sessions[i].closed = true;
 		}
-		if (ra > P2 && ra < P3) {
-			rx = (((int)map.player.x >> 6) << 6) - 0.0001;
-			ry = (map.player.x - rx) * nTan + map.player.y;
-			xo = -64; yo = -xo * nTan;
+
+		if (fds[0].revents & POLLIN) {
+			int fd;
+			while ((fd = accept(listenFd, nullptr, nullptr)) >= 0) {
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				Session s;
+				s.fd = fd;
+				s.player = map.player;
+				s.player.lantern = -1;
+				updateLantern(map, s.player);
+				sessions.push_back(move(s));
+			}
 		}
-		if (ra == 0 || ra == PI) {
-			rx = map.player.x; ry = map.player.y; dof = 16;
+
+		// a dig or build redraws everyone close enough to possibly see it
+		const int seeTiles = (int)(spriteDrawDistance / tileSize);
+		for (; seenEdits < map.edits.size(); seenEdits++) {
+			const TileEdit& edit = map.edits[seenEdits];
+			for (Session& s : sessions)
+				if (abs((int)(s.player.x / tileSize) - edit.x) <= seeTiles && abs((int)(s.player.y / tileSize) - edit.y) <= seeTiles)
+					s.dirty = true;
 		}
-		while (dof < 16) {
-			mx = (int)(rx) >> 6;
-			my = (int)(ry) >> 6;
-			if (my >= 0 && mx >= 0 && my < map.sizeY && mx < map.sizeX && map.tileArray[my][mx] == WALL) {
-				vx = rx; vy = ry;
-				disV = dist(map.player.x, map.player.y, vx, vy);
-				break;
-			}
-			else {
-				rx += xo; ry += yo; dof++;
+
+		// A client still draining its last frame is skipped this tick. Its next frame is then
+		// encoded against what it was actually sent, so dropping frames never corrupts the screen.
+		for (Session& s : sessions) {
+			if (s.dirty && !s.closed && s.outbox.empty()) {
+				drawFrame(s.v, map, s.player);
+				encodeFrame(s.v, s.sentFrame, s.outbox);
+				s.dirty = false;
 			}
+			if (!s.closed) flushSession(s);
 		}
-		char c = ' ';
-		if (disV < disH) { rx = vx; ry = vy; disT = disV; c = '#'; }
-		if (disH < disV) { rx = hx; ry = hy; disT = disH; c = '*'; }
 
-		float ca = map.player.angle - ra;
-		if (ca < 0) ca += 2 * PI;
-		if (ca > 2 * PI) ca -= 2 * PI;
-
-		disT *= cos(ca) + 0.0001;
+		for (size_t i = 0; i < sessions.size();) {
+			if (!sessions[i].closed) { i++; continue; }
+			close(sessions[i].fd);
+			removeLight(map.lights, sessions[i].player.lantern);
+			sessions[i] = move(sessions.back());
+			sessions.pop_back();
+		}
+	}
+	close(listenFd);
+	unlink(path);
+	return 0;
+}
 
-		int lineH = (map.tileSize * v.sizeY) / disT;
-		if (lineH > v.sizeY) lineH = v.sizeY;
+int runClient(const char* path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("client");
+		return 1;
+	}
 
+	int sizeX{}, sizeY{};
+	getTerminalSize(sizeX, sizeY);
+	sizeX = clamp(sizeX, 1, maxSessionX);
+	sizeY = clamp(sizeY, 1, maxSessionY);
+	unsigned char hello[4] = { (unsigned char)sizeX, (unsigned char)(sizeX >> 8), (unsigned char)sizeY, (unsigned char)(sizeY >> 8) };
+	send(fd, hello, sizeof(hello), MSG_NOSIGNAL);
 
-		placeWall(v, r, 0, lineH, c);
+	struct termios old_termios, new_termios;
+	tcgetattr(STDIN_FILENO, &old_termios);
+	new_termios = old_termios;
+	new_termios.c_lflag &= ~(ICANON | ECHO);
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
 
-		ra += DEG;
-		if (ra < 0) ra += 2 * PI;
-		if (ra > 2 * PI) ra -= 2 * PI;
+	char buffer[4096];
+	pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+	while (poll(fds, 2, -1) >= 0) {
+		if (fds[0].revents & POLLIN) {
+			ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+			if (n <= 0 || send(fd, buffer, n, MSG_NOSIGNAL) < 0) break;
+		}
+		if (fds[1].revents & (POLLIN | POLLHUP)) {
+			ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+			if (n <= 0) break;
+			fwrite(buffer, 1, n, stdout);
+			fflush(stdout);
+		}
 	}
+
+	tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
+	close(fd);
+	return 0;
 }
+#endif // Linux
 
-// ----------[ MAIN ]--------------
+// ----------[ BATCH ]--------------
+// Generates a range of seeds headless, one worker per core, and streams one line of stats per floor.
 
-void handleInput(char key, Map& map, view& v) {
-	switch (key)
-	{
-	case 'a':
-		map.player.angle -= 0.1;
-		if (map.player.angle < 0) map.player.angle += 2 * PI;
-		map.player.deltaX = cos(map.player.angle) * 5;
-		map.player.deltaY = sin(map.player.angle) * 5;
-		break;
-	case 'd':
-		map.player.angle += 0.1;
-		if (map.player.angle > 2 * PI) map.player.angle -= 2 * PI;
-		map.player.deltaX = cos(map.player.angle) * 5;
-		map.player.deltaY = sin(map.player.angle) * 5;
-		break;
-	case 'w':
-		if (getTileFromPlayerCoords(map, map.player.x + map.player.deltaX, map.player.y) != WALL)
-			map.player.x += map.player.deltaX;
-		if (getTileFromPlayerCoords(map, map.player.x, map.player.y + map.player.deltaY) != WALL)
-			map.player.y += map.player.deltaY;
-		break;
-	case 's':
-		if (getTileFromPlayerCoords(map, map.player.x - map.player.deltaX, map.player.y) != WALL)
-			map.player.x -= map.player.deltaX;
-		if (getTileFromPlayerCoords(map, map.player.x, map.player.y - map.player.deltaY) != WALL)
-			map.player.y -= map.player.deltaY;
-		break;
-	case 'e':
-		v.map = !v.map;
+struct FloorStats {
+	unsigned int seed{};
+	int rooms{}, doors{}, corridorLength{};
+	int reachableRooms{}; // rooms reachable from the starting room through rooms, doors and corridors
+	double generationMs{};
+	size_t memoryKB{}; // generation peak plus the rooms
+};
+
+// Flood fill over ROOM_AIR and DOOR from the player's start, before normalizeTiles opens everything up.
+int countReachableRooms(const Map& map) {
+	vector<char> visited((size_t)map.sizeX * map.sizeY, 0);
+	vector<int> open;
+	int start = (int)(map.player.y / tileSize) * map.sizeX + (int)(map.player.x / tileSize);
+	visited[start] = 1;
+	open.push_back(start);
+	while (!open.empty()) {
+		int tile = open.back();
+		open.pop_back();
+		int x = tile % map.sizeX, y = tile / map.sizeX;
+		const int dx[] = { 0, -1, 1, 0 };
+		const int dy[] = { -1, 0, 0, 1 };
+		for (int i = 0; i < 4; i++) {
+			int nX = x + dx[i], nY = y + dy[i];
+			if (nX < 0 || nY < 0 || nX >= map.sizeX || nY >= map.sizeY) continue;
+			Tile t = map.tileArray[nY][nX];
+			if ((t != ROOM_AIR && t != DOOR) || visited[nY * map.sizeX + nX]) continue;
+			visited[nY * map.sizeX + nX] = 1;
+			open.push_back(nY * map.sizeX + nX);
+		}
 	}
 
+	int reachable = 0;
+	for (const Room& room : allRooms(map)) {
+		int x = room.left + room.sizeX / 2;
+		int y = room.top + room.sizeY / 2;
+		reachable += visited[y * map.sizeX + x];
+	}
+	return reachable;
 }
 
-void mainLoop(view& v, Map& map) {
-	char key{};
-#if defined(_WIN32)
-	while (true) {
-		if (_kbhit()) {
-			key = _getch();
-			handleInput(key, map, v);
-			castRays(v, map);
-			if (v.map)
-				viewMap2D(v, map);
-			else
-				renderView(v);
-		}
+FloorStats generateFloorStats(MapParams params) {
+	FloorStats stats;
+	stats.seed = params.seed;
+	params.verbose = false;
+	MemoryAccount memory;
+	if (params.memory) memory.budget = params.memory->budget;
+	params.memory = &memory;
+
+	auto start = chrono::steady_clock::now();
+	Map map = generateMap(params);
+	for (int y = 0; y < map.sizeY; y++)
+		for (int x = 0; x < map.sizeX; x++)
+			stats.doors += map.tileArray[y][x] == DOOR;
+	stats.corridorLength = connectRooms(map);
+	stats.generationMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	stats.rooms = map.roomCount;
+	stats.reachableRooms = countReachableRooms(map);
+	stats.memoryKB = memory.totalPeak / 1024;
+	return stats;
+}
+
+string formatStats(const FloorStats& stats, bool json) {
+	char line[256];
+	if (json)
+		snprintf(line, sizeof(line), "{\"seed\":%u,\"rooms\":%d,\"doors\":%d,\"corridorLength\":%d,\"reachableRooms\":%d,\"generationMs\":%.3f,\"memoryKB\":%zu}\n",
+			stats.seed, stats.rooms, stats.doors, stats.corridorLength, stats.reachableRooms, stats.generationMs, stats.memoryKB);
+	else
+		snprintf(line, sizeof(line), "%u,%d,%d,%d,%d,%.3f,%zu\n",
+			stats.seed, stats.rooms, stats.doors, stats.corridorLength, stats.reachableRooms, stats.generationMs, stats.memoryKB);
+	return line;
+}
+
+// Workers are forked processes, unless tracing. Lines are shorter than PIPE_BUF, so they share one
+// pipe without interleaving.
+int runBatch(MapParams params, unsigned int seedCount, bool json) {
+	unsigned int firstSeed = params.seed;
+#if defined(__linux__)
+	// a trace only sees this process, so a traced batch stays in it
+	bool forked = !traceLog.enabled;
+	// the forked workers already fill every core, each generates its floors on one thread
+	if (forked) {
+		params.routingThreads = 1;
+		params.caveThreads = 1;
 	}
-#elif defined(__linux__)
-	struct termios old_termios, new_termios;
-	tcgetattr(STDIN_FILENO, &old_termios);
-	new_termios = old_termios;
-	new_termios.c_lflag &= ~(ICANON | ECHO);
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-	while (true) {
-		if (read(STDIN_FILENO, &key, 1) > 0) {
-			handleInput(key, map, v);
-			castRays(v, map);
-			if (v.map)
-				viewMap2D(v, map);
-			else
-				renderView(v);
+#endif // Linux
+	// every seed has the same size, so one check covers the whole batch
+	if (!checkMapSize(params) || !checkMemoryBudget(params)) return 1;
+	if (!json) cout << "seed,rooms,doors,corridorLength,reachableRooms,generationMs,memoryKB" << endl;
+#if defined(__linux__)
+	if (forked) {
+		unsigned int workers = max(1u, thread::hardware_concurrency());
+		int pipeFds[2];
+		if (pipe(pipeFds) < 0) {
+			perror("batch");
+			return 1;
 		}
+		for (unsigned int w = 0; w < workers; w++) {
+			if (fork() != 0) continue;
+			close(pipeFds[0]);
+			for (unsigned int i = w; i < seedCount; i += workers) {
+				params.seed = firstSeed + i;
+				string line = formatStats(generateFloorStats(params), json);
+				if (write(pipeFds[1], line.data(), line.size()) < 0) _exit(1);
+			}
+			_exit(0);
+		}
+		close(pipeFds[1]);
+
+		char buffer[4096];
+		ssize_t n;
+		while ((n = read(pipeFds[0], buffer, sizeof(buffer))) > 0)
+			cout.write(buffer, n);
+		cout.flush();
+		close(pipeFds[0]);
+		while (wait(nullptr) > 0) {}
+		return 0;
 	}
-	tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
-#endif // Windows/Linux 
+#endif // Linux
+	for (unsigned int i = 0; i < seedCount; i++) {
+		params.seed = firstSeed + i;
+		cout << formatStats(generateFloorStats(params), json) << flush;
+	}
+	return 0;
 }
 
-void init(view& v, Map& map) {
-	map = generateMap();
+// False if the floor has no valid size or doesn't fit the memory budget, see checkMemoryBudget.
+bool initMap(Map& map, const MapParams& params = MapParams()) {
+	if (!checkMapSize(params) || !checkMemoryBudget(params)) return false;
+	map = generateMap(params);
 	connectRooms(map);
+	labelRegions(map);
 	normalizeTiles(map);
+	map.tiles = compressTiles(map.tileArray);
+	map.tileArray = {};
+	map.arena = {};
+	buildDistanceField(map);
+	buildOverview(map);
+	bakeLights(map.lights, map);
+	placeSprites(map);
 	map.player.deltaX = cos(map.player.angle) * 5;
 	map.player.deltaY = sin(map.player.angle) * 5;
+	return true;
+}
+
+// A save at saver.path wins over params.
+bool init(view& v, Map& map, Saver& saver, const MapParams& params) {
+	SaveGame save;
+	if (readSave(saver.path, save)) {
+		save.params.memory = params.memory;
+		if (!initMap(map, save.params)) return false;
+		applySave(map, save);
+	}
+	else if (!initMap(map, params))
+		return false;
+	saver.params.seed = map.seed;
+	saver.params.roomsX = map.roomsX;
+	saver.params.roomsY = map.roomsY;
+	saver.params.placement = map.placement;
+	updateLantern(map, map.player);
 	v = createView();
-	castRays(v, map);
+	drawFrame(v, map, map.player);
 	renderView(v);
+	return true;
+}
+
+// A whole decimal number from 1 to limit.
+bool parseRoomCount(const char* text, int limit, int& rooms) {
+	char* end = nullptr;
+	errno = 0;
+	long value = strtol(text, &end, 10);
+	if (end == text || *end != '\0' || errno == ERANGE || value < 1 || value > limit) return false;
+	rooms = (int)value;
+	return true;
+}
+
+bool hasFlag(int argc, char** argv, const char* flag) {
+	for (int i = 1; i < argc; i++)
+		if (strcmp(argv[i], flag) == 0) return true;
+	return false;
 }
 
-int main()
+#if !defined(CMDUNGEON_LIBRARY)
+int main(int argc, char** argv)
 {
 	view v;
 	Map map;
-	init(v, map);
+	MapParams params;
+	MemoryAccount memory;
+	params.memory = &memory;
+	// --trace <path> writes a timeline of generation and frames there on exit, see TRACE
+	for (int i = 1; i + 1 < argc; i++)
+		if (strcmp(argv[i], "--trace") == 0) startTrace(argv[i + 1]);
+	if (hasFlag(argc, argv, "--poisson")) params.placement = POISSON_PLACEMENT;
+	if (hasFlag(argc, argv, "--cave")) params.placement = CAVE_PLACEMENT;
+	// --budget <MB> refuses floors that could need more
+	for (int i = 1; i + 1 < argc; i++)
+		if (strcmp(argv[i], "--budget") == 0) memory.budget = (size_t)strtoull(argv[i + 1], nullptr, 10) << 20;
+	// --threads <n> routes corridors and smooths caves on n threads instead of one per core
+	for (int i = 1; i + 1 < argc; i++)
+		if (strcmp(argv[i], "--threads") == 0) params.routingThreads = params.caveThreads = atoi(argv[i + 1]);
+
+	// --batch <firstSeed> <count> [roomsX roomsY] [--poisson | --cave] [--budget <MB>] [--json] [--trace <path>]
+	if (argc > 3 && strcmp(argv[1], "--batch") == 0) {
+		params.seed = (unsigned int)strtoul(argv[2], nullptr, 10);
+		unsigned int count = (unsigned int)strtoul(argv[3], nullptr, 10);
+		if (argc > 5 && strncmp(argv[4], "--", 2) != 0 &&
+			(!parseRoomCount(argv[4], maxMapSide / Room::maxSizeX, params.roomsX) || !parseRoomCount(argv[5], maxMapSide / Room::maxSizeY, params.roomsY))) {
+			cerr << "usage: --batch <firstSeed> <count> [roomsX roomsY], roomsX from 1 to " << maxMapSide / Room::maxSizeX <<
+				", roomsY from 1 to " << maxMapSide / Room::maxSizeY << endl;
+			return 1;
+		}
+		return runBatch(params, count, hasFlag(argc, argv, "--json"));
+	}
+#if defined(__linux__)
+	if (argc > 2 && strcmp(argv[1], "--client") == 0)
+		return runClient(argv[2]);
+	if (argc > 2 && strcmp(argv[1], "--server") == 0) {
+		if (!initMap(map, params)) return 1;
+		return runServer(map, argv[2]);
+	}
+#endif // Linux
+	// [--save <path>] [--poisson | --cave] [--budget <MB>] [--trace <path>], 'q' quits with a memory report
+	Saver saver;
+	saver.path = argc > 2 && strcmp(argv[1], "--save") == 0 ? argv[2] : "CMDungeon3D.sav";
+	if (!init(v, map, saver, params)) return 1;
 
-	mainLoop(v, map);
-}
\ No newline at end of file
+	mainLoop(v, map, saver);
+}
+#endif // !CMDUNGEON_LIBRARY